@@ -1,59 +1,142 @@
 #include "itree.h"
 #include "pr_format.h"
-#include <linux/interval_tree.h>
-#include <linux/rbtree.h>
-#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/maple_tree.h>
+#include <linux/minmax.h>
+#include <linux/rcupdate.h>
 
 int itree_create(struct session *s) {
     mt_init_flags(&s->tree, MT_FLAGS_ALLOC_RANGE | MT_FLAGS_USE_RCU);
+    mutex_init(&s->tree_lock);
     return 0;
 }
 
 void itree_destroy(struct session *s) {
     mtree_destroy(&s->tree);
+    mutex_destroy(&s->tree_lock);
 }
 
-int itree_add(struct session *s, struct b_range *range) {
-    if (itree_subset_of(s, range->start, range->end_excl)) {
-        return -EEXIST;
+/**
+ * itree_next_gap searches the first sector in [start, end_excl) that isn't covered by the tree, it returns false if there
+ * isn't any. Otherwise the gap [gap_start, gap_end_excl) is the run of sectors not covered that starts from that sector.
+ * It must be called inside a RCU read-side critical section.
+ */
+static bool itree_next_gap(struct session *s, unsigned long start, unsigned long end_excl, unsigned long *gap_start, unsigned long *gap_end_excl) {
+    MA_STATE(mas, &s->tree, start, start);
+    unsigned long pos = start;
+    void *entry;
+    *gap_end_excl = end_excl;
+    mas_for_each(&mas, entry, end_excl - 1) {
+        if (mas.index > pos) {
+            // the entry begins after pos, so [pos, mas.index) is not covered
+            *gap_end_excl = mas.index;
+            break;
+        }
+        if (mas.last >= end_excl - 1) {
+            return false;
+        }
+        pos = mas.last + 1;
     }
-    int err = mtree_store_range(&s->tree, range->start, range->end_excl, range, GFP_NOWAIT);
-    return err;
+    *gap_start = pos;
+    return true;
 }
 
-static unsigned long update_span(struct b_range *q, struct b_range *r) {
-    if (q->start >= r->start && q->end_excl <= r->end_excl) {
-        // q:     [-----)
-        // r:  [------------)
-        q->start = q->end_excl;
-    } else if (q->start >= r->start) {
-        // if true then q->end_excl > r->end_excl
-        // q:       [---------------)
-        // r:  [------------)
-        q->start = r->end_excl;
-    } else if (q->end_excl <= r->end_excl) {
-        // if true then q->start < r->start
-        // q:  [----------)
-        // r:      [----------------)
-        q->end_excl = r->start;
-    }
-    return q->end_excl - q->start;
+/**
+ * itree_contains_range returns true if all the sectors in [start, end_excl) are covered by the tree, false otherwise. It never
+ * sleeps, so it can be called by the submit_bio kprobe.
+ */
+bool itree_contains_range(struct session *s, unsigned long start, unsigned long end_excl) {
+    if (start >= end_excl) {
+        return true;
+    }
+    unsigned long gap_start, gap_end_excl;
+    rcu_read_lock();
+    bool found = itree_next_gap(s, start, end_excl, &gap_start, &gap_end_excl);
+    rcu_read_unlock();
+    return !found;
 }
 
 /**
- * itree_subset_of returns true if the range identified by start and len is completely contained in the tree,
- * false otherwise.
+ * itree_find_gaps sets the bit (i - start) of gaps for every sector i in [start, end_excl) that isn't covered by the tree, it
+ * returns the number of those sectors. It never sleeps.
  */
-bool itree_subset_of(struct session *s, unsigned long start, unsigned long end_excl) {
+unsigned long itree_find_gaps(struct session *s, unsigned long start, unsigned long end_excl, unsigned long *gaps) {
+    unsigned long n = 0;
+    unsigned long pos = start;
+    unsigned long gap_start, gap_end_excl;
     rcu_read_lock();
-    struct b_range query = { .start = start, .end_excl = end_excl };
-    struct b_range *r;
-    unsigned long index = start;
-    mt_for_each(&s->tree, r, index, end_excl) {
-        if (!update_span(&query, r)) {
-            break;
+    while (pos < end_excl && itree_next_gap(s, pos, end_excl, &gap_start, &gap_end_excl)) {
+        bitmap_set(gaps, gap_start - start, gap_end_excl - gap_start);
+        n += gap_end_excl - gap_start;
+        pos = gap_end_excl;
+    }
+    rcu_read_unlock();
+    return n;
+}
+
+/**
+ * itree_insert_and_report_new adds [start, end_excl) to the tree and sets the bit idx + (i - start) of added for every sector i
+ * that wasn't covered yet. The range is merged with the ranges it overlaps or touches, they are replaced by a single range, so the
+ * tree holds one range per extent of contiguous sectors. The value of each range is the session itself because the tree only
+ * records coverage. The insertions are serialized by tree_lock, so the tree doesn't change between the lookup and the store,
+ * while the lockless readers always see either the old ranges or the merged one. A range already covered is detected without
+ * taking tree_lock, since ranges are never removed while the session is alive. It may sleep. It returns 0 on success, <0
+ * if the range couldn't be stored, added reports the sectors that weren't covered in both cases.
+ */
+int itree_insert_and_report_new(struct session *s, unsigned long start, unsigned long end_excl, unsigned long *added, unsigned long idx) {
+    if (itree_contains_range(s, start, end_excl)) {
+        return 0;
+    }
+    mutex_lock(&s->tree_lock);
+    MA_STATE(mas, &s->tree, start ? start - 1 : 0, start ? start - 1 : 0);
+    unsigned long lo = start;
+    unsigned long hi = end_excl - 1;
+    unsigned long pos = start;
+    unsigned long new_sectors = 0;
+    unsigned long merged = 0;
+    void *entry;
+    rcu_read_lock();
+    // the ranges that end right before start or begin at end_excl are merged too
+    mas_for_each(&mas, entry, end_excl) {
+        if (mas.index < lo) {
+            lo = mas.index;
         }
+        if (mas.last > hi) {
+            hi = mas.last;
+        }
+        unsigned long gap_end_excl = min(mas.index, end_excl);
+        if (gap_end_excl > pos) {
+            bitmap_set(added, idx + pos - start, gap_end_excl - pos);
+            new_sectors += gap_end_excl - pos;
+        }
+        pos = max(pos, mas.last >= end_excl ? end_excl : mas.last + 1);
+        ++merged;
     }
     rcu_read_unlock();
-    return query.start == query.end_excl;
-}
\ No newline at end of file
+    if (pos < end_excl) {
+        bitmap_set(added, idx + pos - start, end_excl - pos);
+        new_sectors += end_excl - pos;
+    }
+    int err = 0;
+    if (!new_sectors) {
+        goto out;
+    }
+    err = mtree_store_range(&s->tree, lo, hi, s, GFP_NOIO);
+    if (err) {
+        goto out;
+    }
+    WRITE_ONCE(s->nr_extents, s->nr_extents + 1 - merged);
+    WRITE_ONCE(s->nr_sectors, s->nr_sectors + new_sectors);
+out:
+    mutex_unlock(&s->tree_lock);
+    return err;
+}
+
+/**
+ * itree_get_stats returns the number of extents stored in the tree and the number of sectors they cover. The values are read
+ * without tree_lock, so they can be slightly out of date.
+ */
+void itree_get_stats(struct session *s, struct itree_stats *stats) {
+    stats->nr_extents = READ_ONCE(s->nr_extents);
+    stats->nr_sectors = READ_ONCE(s->nr_sectors);
+}
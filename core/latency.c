@@ -0,0 +1,155 @@
+#include "latency.h"
+#include "stats.h"
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/kdev_t.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+#include <linux/percpu.h>
+#include <linux/printk.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/xarray.h>
+// the bucket i counts the latencies in [2^i, 2^(i + 1)) ns, the last one counts the latencies of more than 2^31 ns too
+#define LAT_BUCKETS (32)
+
+static const char *const stage_names[LAT_NR_STAGES] = {
+    [LAT_QUEUE]      = "queue",
+    [LAT_READ]       = "read",
+    [LAT_RESUBMIT]   = "resubmit",
+    [LAT_SAVE_QUEUE] = "save_queue",
+    [LAT_WRITE]      = "write",
+};
+
+struct latency_hist {
+    u64 buckets[LAT_NR_STAGES][LAT_BUCKETS];
+};
+
+/**
+ * latency_dev holds the histograms of a device, each CPU updates its own copy so recording a latency takes no lock.
+ */
+struct latency_dev {
+    dev_t                         dev;
+    struct latency_hist __percpu *hist;
+};
+
+// the histograms indexed by device number, they are released only when the module is unloaded
+static DEFINE_XARRAY(devices);
+
+/**
+ * latency_dev_add allocates the histograms of dev if they don't exist yet. It may sleep, the latencies of a device are recorded
+ * only after it has been added. It returns 0 on success, -ENOMEM otherwise.
+ */
+int latency_dev_add(dev_t dev) {
+    if (xa_load(&devices, dev)) {
+        return 0;
+    }
+    struct latency_dev *d = kzalloc(sizeof(*d), GFP_NOIO);
+    if (!d) {
+        return -ENOMEM;
+    }
+    d->dev = dev;
+    d->hist = alloc_percpu_gfp(struct latency_hist, GFP_NOIO);
+    if (!d->hist) {
+        kfree(d);
+        return -ENOMEM;
+    }
+    int err = xa_insert(&devices, dev, d, GFP_NOIO);
+    if (err) {
+        free_percpu(d->hist);
+        kfree(d);
+    }
+    return err == -EBUSY ? 0 : err;
+}
+
+/**
+ * latency_record adds the time elapsed since start_ns to the histogram of stage of device dev. It never sleeps, so it can be called
+ * from the completion of a bio. A start_ns of zero means that the stage hasn't been timed.
+ */
+void latency_record(dev_t dev, enum latency_stage stage, u64 start_ns) {
+    if (!start_ns) {
+        return;
+    }
+    struct latency_dev *d = xa_load(&devices, dev);
+    if (!d) {
+        return;
+    }
+    u64 ns = ktime_get_ns() - start_ns;
+    unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), LAT_BUCKETS - 1) : 0;
+    this_cpu_inc(d->hist->buckets[stage][bucket]);
+}
+
+/**
+ * latency_seq_show prints a line for each device and stage in the format:
+ * <major>:<minor> <stage> <count of bucket 0> ... <count of bucket 31>
+ */
+static int latency_seq_show(struct seq_file *m, void *v) {
+    struct latency_dev *d;
+    unsigned long idx;
+    xa_for_each(&devices, idx, d) {
+        for (int stage = 0; stage < LAT_NR_STAGES; ++stage) {
+            seq_printf(m, "%d:%d %s", MAJOR(d->dev), MINOR(d->dev), stage_names[stage]);
+            for (int b = 0; b < LAT_BUCKETS; ++b) {
+                u64 sum = 0;
+                int cpu;
+                for_each_possible_cpu(cpu) {
+                    sum += READ_ONCE(per_cpu_ptr(d->hist, cpu)->buckets[stage][b]);
+                }
+                seq_printf(m, " %llu", sum);
+            }
+            seq_putc(m, '\n');
+        }
+    }
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(latency_seq);
+
+/**
+ * latency_reset_write zeroes every histogram whatever is written. The latencies recorded while the histograms are being reset can
+ * be lost.
+ */
+static ssize_t latency_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    struct latency_dev *d;
+    unsigned long idx;
+    xa_for_each(&devices, idx, d) {
+        int cpu;
+        for_each_possible_cpu(cpu) {
+            memset(per_cpu_ptr(d->hist, cpu), 0, sizeof(struct latency_hist));
+        }
+    }
+    return count;
+}
+
+static const struct file_operations latency_reset_fops = {
+    .owner = THIS_MODULE,
+    .write = latency_reset_write,
+    .llseek = noop_llseek,
+};
+
+/**
+ * latency_init creates the files latency and latency_reset in the debugfs directory of the module, if it exists.
+ */
+void latency_init(void) {
+    struct dentry *dir = stats_debugfs_dir();
+    if (!dir) {
+        return;
+    }
+    debugfs_create_file("latency", 0440, dir, NULL, &latency_seq_fops);
+    debugfs_create_file("latency_reset", 0220, dir, NULL, &latency_reset_fops);
+}
+
+/**
+ * latency_cleanup releases the histograms, it must be called after the debugfs directory has been removed and no stage can be
+ * recorded anymore.
+ */
+void latency_cleanup(void) {
+    struct latency_dev *d;
+    unsigned long idx;
+    xa_for_each(&devices, idx, d) {
+        free_percpu(d->hist);
+        kfree(d);
+    }
+    xa_destroy(&devices);
+}
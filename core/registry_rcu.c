@@ -5,7 +5,9 @@
 #include "pr_format.h"
 #include "session.h"
 #include "snapshot.h"
+#include "watched.h"
 #include <linux/blkdev.h>
+#include <linux/hashtable.h>
 #include <linux/list.h>
 #include <linux/printk.h>
 #include <linux/rculist.h>
@@ -13,6 +15,8 @@
 #include <linux/spinlock.h>
 #include <linux/time.h>
 #include <linux/uuid.h>
+// number of bits of the hash table that indexes the sessions by device number
+#define REGISTRY_DEV_BITS (8)
 
 // Little auxiliary struct used by "by_dev_and_time_ge" predicate
 struct node_dev {
@@ -26,9 +30,11 @@ struct node_name {
     unsigned long  hash;
 };
 
-// All snapshot metadata are stored in a doubly-linked list
+// All snapshot metadata are stored in a doubly-linked list, the ones with an active session are
+// also linked to a hash table keyed by the device number of the session
 struct snapshot_metadata {
     struct list_head  list;
+    struct hlist_node dev_node;
     // speed up searches by making string comparisons only on collisions or matches
     unsigned long     dev_name_hash; 
     char             *dev_name;
@@ -39,6 +45,9 @@ struct snapshot_metadata {
 
 LIST_HEAD(registry_db);
 DEFINE_SPINLOCK(write_lock);
+// registry_by_dev speeds up the lookups made by the submit_bio kprobe, it is updated together with
+// registry_db while holding write_lock
+static DEFINE_HASHTABLE(registry_by_dev, REGISTRY_DEV_BITS);
 
 /**
  * registry_init initializes all necessary data structures to manage snapshots credentials
@@ -57,6 +66,8 @@ void registry_cleanup(void) {
 
     spin_lock_irqsave(&write_lock, flags);
     list_splice_init(&registry_db, &list);
+    hash_init(registry_by_dev);
+    watched_reset();
     spin_unlock_irqrestore(&write_lock, flags);
 
     synchronize_rcu();
@@ -64,7 +75,7 @@ void registry_cleanup(void) {
     list_for_each_entry_safe(it, tmp, &list, list) {
         struct session *s = it->session;
         if (s) {
-            session_destroy(s);
+            session_put(s);
         }
         kfree(it);
     }
@@ -114,6 +125,57 @@ static inline struct snapshot_metadata *registry_get_by_rcu(bool (*pred)(struct
     return NULL;
 }
 
+/**
+ * registry_get_by_dev looks up for a node with an active session on device dev that satisfies a certain predicate: pred.
+ * It must be called while the spinlock is held!
+ */
+static inline struct snapshot_metadata *registry_get_by_dev(dev_t dev, bool (*pred)(struct snapshot_metadata*, const void*), const void *args) {
+    struct snapshot_metadata *it;
+    hash_for_each_possible(registry_by_dev, it, dev_node, dev) {
+        if (pred(it, args)) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * registry_get_by_dev_rcu is the same as registry_get_by_dev but it must be called inside a RCU critical section!
+ */
+static inline struct snapshot_metadata *registry_get_by_dev_rcu(dev_t dev, bool (*pred)(struct snapshot_metadata*, const void*), const void *args) {
+    struct snapshot_metadata *it;
+    hash_for_each_possible_rcu(registry_by_dev, it, dev_node, dev) {
+        if (pred(it, args)) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * dev_index_add links node to the hash table of the active sessions and adds its device to the filter of the watched devices,
+ * nodes without a session are ignored. It must be called while the spinlock is held!
+ */
+static inline void dev_index_add(struct snapshot_metadata *node) {
+    struct session *s = node->session;
+    if (s) {
+        hash_add_rcu(registry_by_dev, &node->dev_node, s->dev);
+        watched_add(s->dev);
+    }
+}
+
+/**
+ * dev_index_del unlinks node from the hash table of the active sessions and removes its device from the filter of the watched
+ * devices. It must be called while the spinlock is held!
+ */
+static inline void dev_index_del(struct snapshot_metadata *node) {
+    struct session *s = node->session;
+    if (s) {
+        hash_del_rcu(&node->dev_node);
+        watched_del(s->dev);
+    }
+}
+
 static inline bool by_name(struct snapshot_metadata *node, const void *args) {
     struct node_name *name = (struct node_name*)args;
     return node->dev_name_hash == name->hash && !strcmp(node->dev_name, name->name);
@@ -155,7 +217,7 @@ static inline struct snapshot_metadata *get_by_dev_and_time_ge_rcu(dev_t dev, st
         .dev = dev,
         .time = time,
     };
-    return registry_get_by_rcu(by_dev_and_time_ge, &nd);
+    return registry_get_by_dev_rcu(dev, by_dev_and_time_ge, &nd);
 }
 
 static inline struct snapshot_metadata *node_alloc_noname(gfp_t gfp) {
@@ -165,6 +227,7 @@ static inline struct snapshot_metadata *node_alloc_noname(gfp_t gfp) {
         return NULL;
     }
     INIT_LIST_HEAD(&node->list);
+    INIT_HLIST_NODE(&node->dev_node);
     return node;
 }
 
@@ -239,7 +302,7 @@ static void registry_delete_rcu(struct rcu_head *head) {
     struct session *s = node->session;
     if (s) {
         snap_map_destroy(s->dev, &s->created_on);
-        session_destroy(s);
+        session_put(s);
     }
     kfree(node->dev_name);
     kfree(node);
@@ -258,6 +321,7 @@ int registry_delete(const char *dev_name) {
     int err;
     if (it) {
         list_del_rcu(&it->list);
+        dev_index_del(it);
         err = 0;
     } else {
         err = -EWRONGCRED;
@@ -275,7 +339,7 @@ static void free_session_rcu(struct rcu_head *head) {
     struct session *s = node->session;
     if (s) {
         snap_map_destroy(s->dev, &s->created_on);
-        session_destroy(s);
+        session_put(s);
     }
     kfree(node);
 }
@@ -313,6 +377,8 @@ int registry_session_prealloc(const char *dev_name, dev_t dev) {
     new_node->dev_name_hash = current_node->dev_name_hash;
     new_node->dev_name_len = current_node->dev_name_len;
     list_replace_rcu(&current_node->list, &new_node->list);
+    dev_index_add(new_node);
+    dev_index_del(current_node);
     spin_unlock_irqrestore(&write_lock, flags);
 
     if (free_old_session) {
@@ -323,7 +389,7 @@ int registry_session_prealloc(const char *dev_name, dev_t dev) {
 release_lock:
     spin_unlock_irqrestore(&write_lock, flags);
     kfree(new_node);
-    session_destroy(new_ssn);
+    session_put(new_ssn);
     return err;
 }
 
@@ -410,7 +476,7 @@ void registry_session_destroy(dev_t dev) {
 
     unsigned long flags;
     spin_lock_irqsave(&write_lock, flags);
-    struct snapshot_metadata *it = registry_get_by(by_dev, &dev);
+    struct snapshot_metadata *it = registry_get_by_dev(dev, by_dev, &dev);
     int err = 0;
     if (!it) {
         err = -ENOSSN;
@@ -423,6 +489,7 @@ void registry_session_destroy(dev_t dev) {
     new_node->session = NULL;
 
     list_replace_rcu(&it->list, &new_node->list);
+    dev_index_del(it);
 
 no_session:
     spin_unlock_irqrestore(&write_lock, flags);
@@ -434,20 +501,24 @@ no_session:
 }
 
 /**
- * registry_add_range adds a range [sector, sector + len] to a session associated to a device number dev.
+ * registry_add_range adds the sectors [start, end_excl) to the session of device dev created on created_on, it sets the bit
+ * idx + (i - start) of added for every sector i that wasn't in the session yet. It may sleep.
  */
-int registry_add_range(dev_t dev, struct timespec64 *created_on, struct b_range *range) {
+int registry_add_range(dev_t dev, struct timespec64 *created_on, unsigned long start, unsigned long end_excl, unsigned long *added,
+                       unsigned long idx) {
     rcu_read_lock();
     struct snapshot_metadata *it = get_by_dev_and_time_ge_rcu(dev, created_on);
-    int err;
-    if (!it) {
-        err = -ENOSSN;
-        pr_debug(pr_format("registry_add_range: no session associated to device %d:%d"), MAJOR(dev), MINOR(dev));
-        goto out;
+    struct session *s = it ? it->session : NULL;
+    if (s && !session_get(s)) {
+        s = NULL;
     }
-    err = itree_add(it->session, range);
-out:
     rcu_read_unlock();
+    if (!s) {
+        pr_debug(pr_format("registry_add_range: no session associated to device %d:%d"), MAJOR(dev), MINOR(dev));
+        return -ENOSSN;
+    }
+    int err = itree_insert_and_report_new(s, start, end_excl, added, idx);
+    session_put(s);
     return err;
 }
 
@@ -460,17 +531,34 @@ out:
  */
 int registry_lookup_range(dev_t dev, unsigned long start, unsigned long end_excl) {
     rcu_read_lock();
-    struct snapshot_metadata *it = registry_get_by_rcu(by_dev, &dev);
+    struct snapshot_metadata *it = registry_get_by_dev_rcu(dev, by_dev, &dev);
     int err;
     if (!it) {
         err = -ENOSSN;
     } else {
-        err = itree_subset_of(it->session, start, end_excl) ? -EEXIST : 0;
+        err = itree_contains_range(it->session, start, end_excl) ? -EEXIST : 0;
     }
     rcu_read_unlock();
     return err;
 }
 
+/**
+ * registry_lookup_gaps sets the bit (i - start) of gaps for every sector i in [start, end_excl) that the session of device dev
+ * hasn't preserved yet. It returns the number of those sectors, or -ENOSSN if dev has no session.
+ */
+long registry_lookup_gaps(dev_t dev, unsigned long start, unsigned long end_excl, unsigned long *gaps) {
+    rcu_read_lock();
+    struct snapshot_metadata *it = registry_get_by_dev_rcu(dev, by_dev, &dev);
+    long n;
+    if (!it || !it->session) {
+        n = -ENOSSN;
+    } else {
+        n = itree_find_gaps(it->session, start, end_excl, gaps);
+    }
+    rcu_read_unlock();
+    return n;
+}
+
 static inline ssize_t length(struct snapshot_metadata *it) {
     size_t n = strlen(it->dev_name) + 1; // + length of " "
     struct session *s = it->session;
@@ -524,4 +612,39 @@ ssize_t registry_show_session(char *buf, size_t size) {
     }
     kfree(dirname);
     return br;
-}
\ No newline at end of file
+}
+/**
+ * registry_show_extents prints into buf the fragmentation of the active sessions in the format:
+ * <device name> <extents> <sectors> <average extent length in sectors>
+ *
+ * Like registry_show_session, the list is terminated with EOF if it doesn't fit in the buffer.
+ */
+ssize_t registry_show_extents(char *buf, size_t size) {
+    rcu_read_lock();
+    int err = 0;
+    ssize_t br = 0;
+    struct snapshot_metadata *it;
+    list_for_each_entry_rcu(it, &registry_db, list) {
+        struct session *s = it->session;
+        if (!s) {
+            continue;
+        }
+        struct itree_stats stats;
+        itree_get_stats(s, &stats);
+        int n = snprintf(&buf[br], size - br, "%s %lu %lu %lu\n", it->dev_name, stats.nr_extents, stats.nr_sectors,
+                         stats.nr_extents ? stats.nr_sectors / stats.nr_extents : 0);
+        if (br + n >= size) {
+            buf[br] = '\0';
+            err = -1;
+            break;
+        }
+        br += n;
+    }
+    rcu_read_unlock();
+    if (err && br + strlen("EOF") < size) {
+        br += sprintf(&buf[br], "EOF");
+    } else if (!br) {
+        br += sprintf(buf, "(no sessions)\n");
+    }
+    return br;
+}
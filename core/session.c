@@ -22,6 +22,7 @@ struct session *session_create(dev_t dev) {
     if (!s) {
         return NULL;
     }
+    kref_init(&s->ref);
     ktime_get_real_ts64(&s->created_on);
     if (itree_create(s)) {
         goto out;
@@ -35,7 +36,20 @@ out:
     return NULL;
 }
 
-void session_destroy(struct session *s) {
+static void session_release(struct kref *ref) {
+    struct session *s = container_of(ref, struct session, ref);
     itree_destroy(s);
     kfree(s);
+}
+
+/**
+ * session_get takes a reference to s, it returns false if s is being released. The caller must be inside a RCU read-side
+ * critical section that found s in the registry.
+ */
+bool session_get(struct session *s) {
+    return kref_get_unless_zero(&s->ref);
+}
+
+void session_put(struct session *s) {
+    kref_put(&s->ref, session_release);
 }
\ No newline at end of file
@@ -1,76 +1,200 @@
 #include "snapshot.h"
-#include "../rbitmap/rbitmap32.h"
 #include "bio.h"
 #include "itree.h"
+#include "latency.h"
 #include "pr_format.h"
 #include "registry.h"
 #include "small_bitmap.h"
+#include "snap_format.h"
+#include "stats.h"
 #include <linux/bio.h>
 #include <linux/bitmap.h>
 #include <linux/blkdev.h>
 #include <linux/bvec.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#include <linux/crc32.h>
+#else
+#include <linux/crc32c.h>
+#endif
 #include <linux/dcache.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
 #include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/log2.h>
+#include <linux/mempool.h>
 #include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/stat.h>
 #include <linux/string.h>
 #include <linux/time64.h>
+#include <linux/uio.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 #define ROOT_DIR  "/snapshots"
+// maximum number of ordered workqueues used to process the intercepted writes
+#define WRITE_BIO_WQ_MAX (16)
+// number of bytes reserved by each call to vfs_fallocate when the data file is written with direct I/O
+#define SNAP_PREALLOC_CHUNK (64UL << 20)
+// maximum number of asynchronous writes that can be in flight on the data file of a snap_map
+#define SNAP_MAX_INFLIGHT (64)
 
 /**
- * Little auxiliary struct that represents the header of each block saved in the data file
- * of a snapshot.
+ * snap_index_chunk holds the entries of the index of a data file, they are kept in memory until the snap_map is released.
  */
-struct snap_block_header {
-    sector_t      sector;
-    unsigned long nbytes;
+struct snap_index_chunk {
+    struct list_head        list;
+    unsigned int            len;
+    struct snap_index_entry entry[];
 };
 
+// number of entries of a snap_index_chunk, a chunk takes a page
+#define SNAP_INDEX_CHUNK_LEN ((PAGE_SIZE - sizeof(struct snap_index_chunk)) / sizeof(struct snap_index_entry))
+
 /**
  * This struct keeps track of the sectors of a certain device which have been already saved by the module.
  * A snap_map is uniquely identified by the pair device number and session_created_on. It uses srcu because
- * the operations provided by rbitmap32 may block.
+ * writing to the data file may block.
  */
 struct snap_map {
     struct callback_head  head;
+    struct work_struct    free_work;
+    // the list of maps, every write queued or in flight and every queued submit_work hold a reference
+    struct kref           ref;
+    atomic_t              inflight;
+    // the writes queued by save_block, submit_work is the only context that submits them to f_data
+    struct llist_head     pending;
+    // the writes taken from pending and not submitted yet (oldest first), only submit_work touches it
+    struct llist_node    *ready;
+    struct work_struct    submit_work;
     struct list_head      list;
     dev_t                 device;
     struct timespec64     session_created_on;
-    struct rbitmap32      bitmap;
-    struct mutex          f_lock;
     struct file          *f_data;
+    // end of the space reserved by the writers of f_data, each record is written at the offset it reserved
+    atomic64_t            f_end;
+    // serializes the calls to vfs_fallocate
+    struct mutex          prealloc_lock;
+    // records are aligned to align bytes, it's 1 if f_data doesn't use direct I/O
+    unsigned int          align;
+    // alignment required by direct I/O to the memory of the data written
+    unsigned int          mem_align;
+    // end of the space reserved by vfs_fallocate, it's meaningful only if prealloc is true
+    loff_t                prealloc_end;
+    bool                  prealloc;
+    // offset of the superblock of the segment written by this map
+    loff_t                segment;
+    // the extents written successfully, index_lost is true if an entry couldn't be allocated
+    spinlock_t            index_lock;
+    struct list_head      index;
+    bool                  index_lost;
 };
 
+/**
+ * write_bio_work and file_work submit the write bios intercepted by the kprobe, resubmitting is the bio while it is being submitted
+ * so that the kprobe lets it through (see snapshot_is_resubmitting).
+ */
 struct write_bio_work {
     struct work_struct  work;
     struct bio         *orig_bio;
+    struct bio         *resubmitting;
+    // when orig_bio has been intercepted (ktime_get_ns)
+    u64                 intercepted_ns;
 };
 
 struct file_work {
     struct work_struct       work;
     struct bio              *orig_bio;
+    struct bio              *resubmitting;
     struct bio_private_data *p_data;
     struct timespec64        read_completed_on;
 };
 
+/**
+ * block_work holds all the pages read by a single read bio, they are saved to the data file of the session
+ * by save_block.
+ */
 struct block_work {
-    struct work_struct work;
-    dev_t              device;
-    sector_t           sector;
-    struct page_iter   data;
-    struct timespec64  session_created_on;
-    char               session_id[];
+    struct work_struct       work;
+    struct bio_private_data *p_data;
+    struct timespec64        session_created_on;
+    // sectors (relative to p_data->sector) that weren't preserved yet by the session, only those are written
+    struct small_bitmap      added;
+    // save_block and every write in flight hold a reference, the pages are released by the last one
+    atomic_t                 ref;
+    // when the work has been queued (ktime_get_ns)
+    u64                      queued_ns;
+};
+
+/**
+ * snap_record describes an extent record of the data file: the header and the bio_vec(s) of the pages where the sectors
+ * of the record are. The header is stored in the same (heap) allocation so a bio_vec can point to it.
+ * When the data file uses direct I/O each piece of the record must be aligned: the header is written at the start of
+ * a zeroed block (head), and the sectors are followed by zeros up to the next aligned offset. If the pages read don't satisfy
+ * the alignment, the sectors are copied to zeroed bounce pages.
+ */
+struct snap_record {
+    struct snap_rec_header   header;
+    void                    *head;
+    bool                     bounced;
+    size_t                   len;
+    int                      nr_bvecs;
+    struct bio_vec           bvec[];
+};
+
+/**
+ * snap_aio is an asynchronous write of a snap_record to the data file of a snap_map. It keeps a reference to the map and to
+ * the block_work that owns the pages of the record from the moment it is queued until the write completes.
+ */
+struct snap_aio {
+    struct kiocb        iocb;
+    struct llist_node   node;
+    struct iov_iter     iter;
+    loff_t              pos;
+    u64                 started_ns;
+    struct snap_map    *map;
+    struct block_work  *owner;
+    struct snap_record *record;
+};
+
+/**
+ * work_pool reserves a minimum number of work items of a certain type, so the copy-on-write pipeline keeps
+ * making progress under memory pressure.
+ */
+struct work_pool {
+    struct kmem_cache *cache;
+    mempool_t         *pool;
+    size_t             size;
 };
 
+static struct work_pool write_bio_work_pool;
+
+static struct work_pool file_work_pool;
+
+static struct work_pool block_work_pool;
+
 static LIST_HEAD(map_list);
 
 static DEFINE_SPINLOCK(write_lock);
 
 static struct srcu_struct srcu;
 
-struct workqueue_struct *write_bio_wq;
+/**
+ * The intercepted writes of a device are processed in order by one of the queues in write_bio_wq (it is chosen by hashing the device
+ * number), so the writes to different devices run in parallel while the reads of the ones that target the same device are
+ * submitted in order. The original bios are submitted from read_bio_wq, which doesn't keep that order, see snapshot_save for
+ * why the overlapping writes still preserve the right sectors.
+ */
+static struct workqueue_struct **write_bio_wq;
+
+static unsigned int write_bio_wq_num;
 
 struct workqueue_struct *read_bio_wq;
 
@@ -78,6 +202,14 @@ struct workqueue_struct *save_blocks_wq;
 
 static struct dentry *root_dentry = NULL;
 
+// number of snap_map(s) not released yet, snapshot_cleanup waits for all of them
+static atomic_t live_maps = ATOMIC_INIT(0);
+
+static DECLARE_WAIT_QUEUE_HEAD(live_maps_wq);
+
+// if true the data files are opened with O_DIRECT
+static bool direct_io;
+
 /**
  * parent_directory returns the parent directory of dir.
  * It returns NULL in case of error, an heap allocated string representing the parent
@@ -211,12 +343,124 @@ out:
     return err;
 }
 
+static void write_bio_wq_cleanup(void) {
+    if (!write_bio_wq) {
+        return;
+    }
+    for (unsigned int i = 0; i < write_bio_wq_num; ++i) {
+        if (write_bio_wq[i]) {
+            flush_workqueue(write_bio_wq[i]);
+            destroy_workqueue(write_bio_wq[i]);
+        }
+    }
+    kfree(write_bio_wq);
+    write_bio_wq = NULL;
+}
+
+/**
+ * write_bio_wq_init allocates an ordered workqueue for each CPU (up to WRITE_BIO_WQ_MAX). It returns 0 on success, -ENOMEM otherwise.
+ */
+static int write_bio_wq_init(void) {
+    unsigned int n = min_t(unsigned int, num_possible_cpus(), WRITE_BIO_WQ_MAX);
+    write_bio_wq = kcalloc(n, sizeof(*write_bio_wq), GFP_KERNEL);
+    if (!write_bio_wq) {
+        return -ENOMEM;
+    }
+    write_bio_wq_num = n;
+    for (unsigned int i = 0; i < n; ++i) {
+        write_bio_wq[i] = alloc_ordered_workqueue("write-bio-wq/%u", 0, i);
+        if (!write_bio_wq[i]) {
+            write_bio_wq_cleanup();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static inline struct workqueue_struct *write_bio_wq_of(dev_t dev) {
+    return write_bio_wq[reciprocal_scale(hash_32(dev, 32), write_bio_wq_num)];
+}
+
+static int work_pool_init(struct work_pool *p, const char *name, size_t size, int min_nr) {
+    p->cache = kmem_cache_create(name, size, 0, 0, NULL);
+    if (!p->cache) {
+        return -ENOMEM;
+    }
+    p->pool = mempool_create_slab_pool(min_nr, p->cache);
+    if (!p->pool) {
+        kmem_cache_destroy(p->cache);
+        p->cache = NULL;
+        return -ENOMEM;
+    }
+    p->size = size;
+    return 0;
+}
+
+static void work_pool_destroy(struct work_pool *p) {
+    mempool_destroy(p->pool);
+    p->pool = NULL;
+    kmem_cache_destroy(p->cache);
+    p->cache = NULL;
+}
+
+/**
+ * work_pool_zalloc returns a zeroed work item, it falls back to the reserved items if the slab allocator fails.
+ * It can return NULL only if gfp doesn't allow to wait for an item to be released.
+ */
+static inline void *work_pool_zalloc(struct work_pool *p, gfp_t gfp) {
+    void *w = mempool_alloc(p->pool, gfp);
+    if (w) {
+        memset(w, 0, p->size);
+    }
+    return w;
+}
+
+static inline void work_pool_free(struct work_pool *p, void *w) {
+    mempool_free(w, p->pool);
+}
+
+static void work_pools_destroy(void) {
+    work_pool_destroy(&block_work_pool);
+    work_pool_destroy(&file_work_pool);
+    work_pool_destroy(&write_bio_work_pool);
+}
+
+/**
+ * work_pools_init creates a pool for each type of work item used by the pipeline, each of them reserves min_nr items.
+ */
+static int work_pools_init(int min_nr) {
+    int err = work_pool_init(&write_bio_work_pool, "write_bio_work", sizeof(struct write_bio_work), min_nr);
+    if (err) {
+        return err;
+    }
+    err = work_pool_init(&file_work_pool, "file_work", sizeof(struct file_work), min_nr);
+    if (err) {
+        goto out;
+    }
+    err = work_pool_init(&block_work_pool, "block_work", sizeof(struct block_work), min_nr);
+    if (err) {
+        goto out2;
+    }
+    return 0;
+
+out2:
+    work_pool_destroy(&file_work_pool);
+out:
+    work_pool_destroy(&write_bio_work_pool);
+    return err;
+}
+
 static int snap_map_init(void) {
     init_srcu_struct(&srcu);
     return 0;
 }
 
-int snapshot_init(const char *directory) {
+int snapshot_init(const char *directory, int work_pool_size, bool use_direct_io) {
+    if (work_pool_size <= 0) {
+        pr_err("invalid work pool size %d", work_pool_size);
+        return -EINVAL;
+    }
+    direct_io = use_direct_io;
     int err = snap_map_init();
     if (err) {
         return err;
@@ -225,11 +469,14 @@ int snapshot_init(const char *directory) {
     if (err) {
         return err;
     }
-    write_bio_wq = alloc_ordered_workqueue("write-bio-wq", 0);
-    if (!write_bio_wq) {
-        err = -ENOMEM;
+    err = work_pools_init(work_pool_size);
+    if (err) {
         goto out;
     }
+    err = write_bio_wq_init();
+    if (err) {
+        goto out1;
+    }
     read_bio_wq = alloc_workqueue("save-files-wq", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
     if (!read_bio_wq) {
         err = -ENOMEM;
@@ -245,19 +492,186 @@ int snapshot_init(const char *directory) {
 out3:
     destroy_workqueue(read_bio_wq);
 out2:
-    destroy_workqueue(write_bio_wq);
+    write_bio_wq_cleanup();
+out1:
+    work_pools_destroy();
 out:
     dput(root_dentry);
     return err;
 }
 
+/**
+ * snap_map_release_prealloc gives back the space reserved by vfs_fallocate past the end of the data file.
+ */
+static void snap_map_release_prealloc(struct snap_map *map) {
+    if (!map->prealloc) {
+        return;
+    }
+    loff_t size = i_size_read(file_inode(map->f_data));
+    if (map->prealloc_end > size) {
+        vfs_fallocate(map->f_data, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, size, map->prealloc_end - size);
+    }
+}
+
+static inline unsigned int snap_map_rec_align(struct snap_map *map) {
+    return max_t(unsigned int, map->align, SNAP_REC_ALIGN);
+}
+
+/**
+ * snap_map_write_buf writes len bytes of the vmalloc'd buffer buf at offset pos of the data file. The buffer is page aligned,
+ * so it satisfies the memory alignment of direct I/O. It returns 0 on success, <0 otherwise.
+ */
+static int snap_map_write_buf(struct snap_map *map, void *buf, size_t len, loff_t pos) {
+    int n = DIV_ROUND_UP(len, PAGE_SIZE);
+    struct bio_vec *bvec = kvmalloc_array(n, sizeof(*bvec), GFP_KERNEL);
+    if (!bvec) {
+        return -ENOMEM;
+    }
+    for (int i = 0; i < n; ++i) {
+        bvec_set_page(&bvec[i], vmalloc_to_page(buf + i * PAGE_SIZE), min_t(size_t, PAGE_SIZE, len - i * PAGE_SIZE), 0);
+    }
+    struct iov_iter iter;
+    iov_iter_bvec(&iter, ITER_SOURCE, bvec, n, len);
+    ssize_t ret = vfs_iter_write(map->f_data, &iter, &pos, 0);
+    kvfree(bvec);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == len ? 0 : -EIO;
+}
+
+/**
+ * snap_map_write_super writes the superblock that starts the segment of map.
+ */
+static int snap_map_write_super(struct snap_map *map) {
+    size_t len = round_up(sizeof(struct snap_rec_header) + sizeof(struct snap_superblock), snap_map_rec_align(map));
+    void *buf = vzalloc(len);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    struct snap_rec_header *h = buf;
+    struct snap_superblock *sb = buf + sizeof(*h);
+    h->magic = SNAP_REC_SUPER;
+    h->rec_len = len;
+    h->nbytes = sizeof(*sb);
+    h->data_off = sizeof(*h);
+    sb->version = SNAP_FORMAT_VERSION;
+    sb->align = snap_map_rec_align(map);
+    sb->dev = new_encode_dev(map->device);
+    sb->created_on_sec = map->session_created_on.tv_sec;
+    sb->created_on_nsec = map->session_created_on.tv_nsec;
+    h->crc = crc32c(~0, buf, sizeof(*h) + sizeof(*sb));
+    int err = snap_map_write_buf(map, buf, len, map->segment);
+    vfree(buf);
+    return err;
+}
+
+static int snap_index_cmp(const void *a, const void *b) {
+    const struct snap_index_entry *x = a, *y = b;
+    if (x->sector < y->sector) {
+        return -1;
+    }
+    return x->sector > y->sector;
+}
+
+/**
+ * snap_map_write_index appends to the data file the index of the extents written by map sorted by sector, the footer is written
+ * at the end of the record. It must be called when all the writes of map have completed.
+ */
+static int snap_map_write_index(struct snap_map *map) {
+    if (map->index_lost) {
+        return -ENOMEM;
+    }
+    size_t count = 0;
+    struct snap_index_chunk *c;
+    list_for_each_entry(c, &map->index, list) {
+        count += c->len;
+    }
+    size_t nbytes = count * sizeof(struct snap_index_entry);
+    size_t len = round_up(sizeof(struct snap_rec_header) + nbytes + sizeof(struct snap_footer), snap_map_rec_align(map));
+    void *buf = vzalloc(len);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    struct snap_rec_header *h = buf;
+    struct snap_index_entry *entries = buf + sizeof(*h);
+    size_t i = 0;
+    list_for_each_entry(c, &map->index, list) {
+        memcpy(&entries[i], c->entry, c->len * sizeof(*entries));
+        i += c->len;
+    }
+    sort(entries, count, sizeof(*entries), snap_index_cmp, NULL);
+    loff_t pos = atomic64_read(&map->f_end);
+    h->magic = SNAP_REC_INDEX;
+    h->rec_len = len;
+    h->nbytes = nbytes;
+    h->data_off = sizeof(*h);
+    h->crc = crc32c(crc32c(~0, h, sizeof(*h)), entries, nbytes);
+    struct snap_footer *footer = buf + len - sizeof(*footer);
+    footer->magic = SNAP_FOOTER_MAGIC;
+    footer->index_offset = pos;
+    footer->segment_offset = map->segment;
+    footer->count = count;
+    int err = snap_map_write_buf(map, buf, len, pos);
+    vfree(buf);
+    return err;
+}
+
+static void snap_map_index_free(struct snap_map *map) {
+    struct snap_index_chunk *c, *tmp;
+    list_for_each_entry_safe(c, tmp, &map->index, list) {
+        kfree(c);
+    }
+}
+
 static void snap_map_free(struct snap_map *map) {
-    rbitmap32_destroy(&map->bitmap);
+    snap_map_index_free(map);
+    snap_map_release_prealloc(map);
     filp_close(map->f_data, NULL);
-    mutex_destroy(&map->f_lock);
+    mutex_destroy(&map->prealloc_lock);
     kfree(map);
+    if (atomic_dec_and_test(&live_maps)) {
+        wake_up_all(&live_maps_wq);
+    }
+}
+
+static void snap_map_free_work(struct work_struct *work) {
+    struct snap_map *p = container_of(work, struct snap_map, free_work);
+    int err = snap_map_write_index(p);
+    if (err) {
+        pr_warn("cannot write the index of device %d:%d, got error %d", MAJOR(p->device), MINOR(p->device), err);
+    }
+    snap_map_free(p);
+}
+
+/**
+ * snap_map_release defers the release of a snap_map to a workqueue because closing the data file may sleep, while the last
+ * reference may be dropped by the completion of a write.
+ */
+static void snap_map_release(struct kref *ref) {
+    struct snap_map *p = container_of(ref, struct snap_map, ref);
+    INIT_WORK(&p->free_work, snap_map_free_work);
+    queue_work(save_blocks_wq, &p->free_work);
+}
+
+static inline void snap_map_put(struct snap_map *map) {
+    kref_put(&map->ref, snap_map_release);
+}
+
+/**
+ * snap_map_kick queues the submit_work of map, the work holds a reference to map while it is queued.
+ */
+static void snap_map_kick(struct snap_map *map) {
+    kref_get(&map->ref);
+    if (!queue_work(save_blocks_wq, &map->submit_work)) {
+        snap_map_put(map);
+    }
 }
 
+/**
+ * snap_map_cleanup drops the references held by the list of maps and waits until every map has been released, that is until
+ * all the writes in flight completed. save_blocks_wq must be still alive.
+ */
 static void snap_map_cleanup(void) {
     LIST_HEAD(list);
     spin_lock(&write_lock);
@@ -266,25 +680,28 @@ static void snap_map_cleanup(void) {
     synchronize_srcu(&srcu);
     struct snap_map *pos, *tmp;
     list_for_each_entry_safe(pos, tmp, &list, list) {
-        snap_map_free(pos);
+        snap_map_put(pos);
     }
+    wait_event(live_maps_wq, !atomic_read(&live_maps));
+    flush_workqueue(save_blocks_wq);
     cleanup_srcu_struct(&srcu);
 }
 
 void snapshot_cleanup(void) {
-    if (write_bio_wq) {
-        flush_workqueue(write_bio_wq);
-        destroy_workqueue(write_bio_wq);
-    }
+    write_bio_wq_cleanup();
     if (read_bio_wq) {
         flush_workqueue(read_bio_wq);
         destroy_workqueue(read_bio_wq);
     }
-    if (save_blocks_wq) {
-        flush_workqueue(save_blocks_wq);
-        destroy_workqueue(save_blocks_wq);
-    }
+    // the sessions released by the registry destroy their snap_map(s) in a deferred fashion, the last
+    // step runs on save_blocks_wq
+    rcu_barrier();
+    srcu_barrier(&srcu);
+    flush_workqueue(save_blocks_wq);
     snap_map_cleanup();
+    destroy_workqueue(save_blocks_wq);
+    // the work items are given back to the pools by the completion of the writes
+    work_pools_destroy();
     dput(root_dentry);
 }
 
@@ -333,10 +750,17 @@ out_unlock_put:
     return path;
 }
 
+/**
+ * page_iter_order returns the order of the allocation that holds the bytes [offset, offset + len) of a page_iter.
+ */
+static inline unsigned int page_iter_order(unsigned int offset, unsigned int len) {
+    return get_order(offset + len);
+}
+
 static inline void free_all_pages(struct bio_private_data *p_data) {
     struct page_iter *pos;
     page_iter_for_each(pos, p_data) {
-        __free_pages(pos->page, get_order(pos->len));
+        __free_pages(pos->page, page_iter_order(pos->offset, pos->len));
     }
 }
 
@@ -345,9 +769,12 @@ static void bio_private_data_destroy(struct bio_private_data *p_data) {
     kfree(p_data);
 }
 
+/**
+ * snap_map_destroy_srcu drops the reference of the list of maps, the map is released when the last write in flight completes.
+ */
 static void snap_map_destroy_srcu(struct callback_head *head) {
     struct snap_map *p = container_of(head, struct snap_map, head);
-    snap_map_free(p);
+    snap_map_put(p);
 }
 
 void snap_map_destroy(dev_t dev, struct timespec64 *created_on) {
@@ -368,25 +795,348 @@ void snap_map_destroy(dev_t dev, struct timespec64 *created_on) {
     }
 }
 
-static void snap_map_write(struct snap_map *map, struct page_iter *it, unsigned long offset, unsigned long nbytes, sector_t sector) {
-    if (offset + nbytes > it->offset + it->len) {
-        pr_err("%lu + %lu > %u + %u", offset, nbytes, it->offset, it->len);
+/**
+ * page_iter_slice fills bvec with the bio_vec(s) that cover the bytes [offset, offset + nbytes) of the data read by the read bios,
+ * the offset is relative to the first byte written. The bytes must have been read. It returns the number of bio_vec(s) written
+ * to bvec.
+ */
+static int page_iter_slice(struct bio_private_data *p_data, unsigned long offset, unsigned long nbytes, struct bio_vec *bvec) {
+    int n = 0;
+    struct page_iter *pos;
+    page_iter_for_each(pos, p_data) {
+        unsigned long start = pos->start;
+        unsigned long end = start + pos->len;
+        if (end > offset && start < offset + nbytes) {
+            unsigned long lo = max(start, offset);
+            unsigned long hi = min(end, offset + nbytes);
+            bvec_set_page(&bvec[n++], pos->page, hi - lo, pos->offset + (lo - start));
+        }
+    }
+    return n;
+}
+
+/**
+ * page_iter_next_region returns the next run of sectors [first, last_excl) read by the read bios (relative to p_data->sector),
+ * starting from the page_iter *i. It returns false if there are no more runs.
+ */
+static bool page_iter_next_region(struct bio_private_data *p_data, int *i, unsigned long *first, unsigned long *last_excl) {
+    if (*i >= p_data->iter_len) {
+        return false;
+    }
+    struct page_iter *pos = &p_data->iter[*i];
+    unsigned long start = pos->start;
+    unsigned long end = start + pos->len;
+    for (++*i; *i < p_data->iter_len && p_data->iter[*i].start == end; ++*i) {
+        end += p_data->iter[*i].len;
+    }
+    *first = start / 512;
+    *last_excl = DIV_ROUND_UP(end, 512);
+    return true;
+}
+
+static bool snap_bvecs_aligned(struct bio_vec *bvec, int n, unsigned int align, unsigned int mem_align) {
+    for (int i = 0; i < n; ++i) {
+        if ((bvec[i].bv_len & (align - 1)) || (bvec[i].bv_offset & (mem_align - 1))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * snap_record_bounce copies the sectors of r to freshly allocated pages followed by tail_len bytes of padding, they
+ * replace the bio_vec(s) of the sectors. It returns 0 on success, -ENOMEM otherwise.
+ */
+static int snap_record_bounce(struct snap_record *r, int nr_data_bvecs, size_t tail_len) {
+    size_t nbytes = r->header.nbytes;
+    size_t total = nbytes + tail_len;
+    int n = DIV_ROUND_UP(total, PAGE_SIZE);
+    struct page **pages = kmalloc_array(n, sizeof(*pages), GFP_NOIO);
+    if (!pages) {
+        return -ENOMEM;
+    }
+    struct iov_iter src;
+    iov_iter_bvec(&src, ITER_SOURCE, &r->bvec[1], nr_data_bvecs, nbytes);
+    for (int i = 0; i < n; ++i) {
+        pages[i] = alloc_page(GFP_NOIO | __GFP_ZERO);
+        if (!pages[i]) {
+            while (i--) {
+                __free_page(pages[i]);
+            }
+            kfree(pages);
+            return -ENOMEM;
+        }
+        size_t len = min_t(size_t, PAGE_SIZE, nbytes - min_t(size_t, nbytes, i * PAGE_SIZE));
+        if (len) {
+            copy_from_iter(page_address(pages[i]), len, &src);
+        }
+    }
+    // the bio_vec(s) of the sectors can be overwritten only after the copy completes
+    for (int i = 0; i < n; ++i) {
+        bvec_set_page(&r->bvec[1 + i], pages[i], min_t(size_t, PAGE_SIZE, total - i * PAGE_SIZE), 0);
+    }
+    kfree(pages);
+    r->nr_bvecs = 1 + n;
+    r->bounced = true;
+    return 0;
+}
+
+/**
+ * snap_record_align lays out r as described in struct snap_record so that it can be written with direct I/O.
+ */
+static int snap_record_align(struct snap_record *r, struct snap_map *map, int nr_data_bvecs) {
+    unsigned int align = map->align;
+    size_t nbytes = r->header.nbytes;
+    // kmalloc aligns the objects whose size is a power of 2 to their size
+    r->head = kzalloc(align, GFP_NOIO);
+    if (!r->head) {
+        return -ENOMEM;
+    }
+    memcpy(r->head, &r->header, sizeof(r->header));
+    bvec_set_virt(&r->bvec[0], r->head, align);
+    size_t tail_len = r->len - align - nbytes;
+    // if every bio_vec is aligned then so is their total length, and the sectors need no tail
+    if (!snap_bvecs_aligned(&r->bvec[1], nr_data_bvecs, align, map->mem_align)) {
+        return snap_record_bounce(r, nr_data_bvecs, tail_len);
+    }
+    return 0;
+}
+
+static void snap_record_free(struct snap_record *r) {
+    if (r->bounced) {
+        for (int i = 1; i < r->nr_bvecs; ++i) {
+            __free_page(r->bvec[i].bv_page);
+        }
+    }
+    kfree(r->head);
+    kfree(r);
+}
+
+/**
+ * snap_record_checksum computes the crc32c of the header of r (whose crc is still zero) followed by its sectors. A reader that finds
+ * an extent whose checksum doesn't match knows that the extent has been torn by a crash.
+ */
+static u32 snap_record_checksum(struct snap_record *r, int nr_data_bvecs) {
+    u32 crc = crc32c(~0, &r->header, sizeof(r->header));
+    for (int i = 1; i <= nr_data_bvecs; ++i) {
+        struct bio_vec *bv = &r->bvec[i];
+        unsigned int done = 0;
+        while (done < bv->bv_len) {
+            unsigned int offset = bv->bv_offset + done;
+            unsigned int len = min_t(unsigned int, bv->bv_len - done, PAGE_SIZE - offset_in_page(offset));
+            void *addr = kmap_local_page(bv->bv_page + offset / PAGE_SIZE);
+            crc = crc32c(crc, addr + offset_in_page(offset), len);
+            kunmap_local(addr);
+            done += len;
+        }
+    }
+    return crc;
+}
+
+static struct snap_record *snap_record_alloc(struct snap_map *map, struct bio_private_data *p_data, unsigned long first, unsigned long last_excl) {
+    unsigned long nbytes = (last_excl - first) * 512;
+    int max_bvecs = p_data->iter_len + 1;
+    if (map->align > 1) {
+        max_bvecs = max_t(int, max_bvecs, 1 + DIV_ROUND_UP(round_up(nbytes, map->align), PAGE_SIZE));
+    }
+    struct snap_record *r;
+    r = kzalloc(struct_size(r, bvec, max_bvecs), GFP_NOIO);
+    if (!r) {
+        return NULL;
+    }
+    r->header.magic = SNAP_REC_EXTENT;
+    r->header.sector = p_data->sector + first;
+    r->header.nbytes = nbytes;
+    if (map->align == 1) {
+        r->header.data_off = sizeof(r->header);
+        r->len = sizeof(r->header) + nbytes;
+    } else {
+        r->header.data_off = map->align;
+        r->len = map->align + round_up(nbytes, map->align);
+    }
+    r->header.rec_len = r->len;
+    int nr_data_bvecs = page_iter_slice(p_data, first * 512, nbytes, &r->bvec[1]);
+    r->nr_bvecs = 1 + nr_data_bvecs;
+    r->header.crc = snap_record_checksum(r, nr_data_bvecs);
+    if (map->align == 1) {
+        bvec_set_virt(&r->bvec[0], &r->header, sizeof(r->header));
+        return r;
+    }
+    if (snap_record_align(r, map, nr_data_bvecs)) {
+        snap_record_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/**
+ * snap_map_prealloc makes sure that the space of the data file up to end has been reserved. Only the writer that crosses the
+ * end of the reserved space takes prealloc_lock. Preallocation is disabled as soon as vfs_fallocate fails.
+ */
+static void snap_map_prealloc(struct snap_map *map, loff_t end) {
+    if (!READ_ONCE(map->prealloc) || end <= READ_ONCE(map->prealloc_end)) {
         return;
     }
-    mutex_lock(&map->f_lock);
-    struct snap_block_header header = { .sector = sector, .nbytes = nbytes };
-    ssize_t n = kernel_write(map->f_data, &header, sizeof(header), &(map->f_data->f_pos));
-    if (n != sizeof(header)) {
-        pr_err("kernel_write failed to write index of device %d:%d", MAJOR(map->device), MINOR(map->device));
-        goto out;
+    mutex_lock(&map->prealloc_lock);
+    while (map->prealloc && end > map->prealloc_end) {
+        int err = vfs_fallocate(map->f_data, FALLOC_FL_KEEP_SIZE, map->prealloc_end, SNAP_PREALLOC_CHUNK);
+        if (err) {
+            pr_warn("vfs_fallocate failed on data file of device %d:%d, got error %d", MAJOR(map->device), MINOR(map->device), err);
+            WRITE_ONCE(map->prealloc, false);
+        } else {
+            WRITE_ONCE(map->prealloc_end, map->prealloc_end + SNAP_PREALLOC_CHUNK);
+        }
     }
-    void *va = page_address(it->page) + it->offset;
-    n = kernel_write(map->f_data, va + offset, nbytes, &(map->f_data->f_pos));
-    if (n != nbytes) {
-        pr_err("kernel_write failed to write whole page of device %d:%d", MAJOR(map->device), MINOR(map->device));
+    mutex_unlock(&map->prealloc_lock);
+}
+
+static void block_work_put(struct block_work *w) {
+    if (atomic_dec_and_test(&w->ref)) {
+        bio_private_data_destroy(w->p_data);
+        small_bitmap_free(&w->added);
+        work_pool_free(&block_work_pool, w);
+    }
+}
+
+/**
+ * snap_map_index_add adds to the index of map the extent described by h, that has been written at pos. It may be called in interrupt
+ * context, if a new chunk can't be allocated the index is lost and it won't be written to the data file.
+ */
+static void snap_map_index_add(struct snap_map *map, struct snap_rec_header *h, loff_t pos) {
+    unsigned long flags;
+    spin_lock_irqsave(&map->index_lock, flags);
+    if (map->index_lost) {
+        goto out;
     }
+    struct snap_index_chunk *c = list_empty(&map->index) ? NULL : list_last_entry(&map->index, struct snap_index_chunk, list);
+    if (!c || c->len == SNAP_INDEX_CHUNK_LEN) {
+        c = kmalloc(PAGE_SIZE, GFP_ATOMIC);
+        if (!c) {
+            stats_inc(STAT_ALLOC_FAILURES);
+            pr_warn("out of memory, the index of device %d:%d won't be written", MAJOR(map->device), MINOR(map->device));
+            map->index_lost = true;
+            goto out;
+        }
+        c->len = 0;
+        list_add_tail(&c->list, &map->index);
+    }
+    struct snap_index_entry *e = &c->entry[c->len++];
+    e->sector = h->sector;
+    e->offset = pos;
+    e->nbytes = h->nbytes;
+    e->reserved = 0;
 out:
-    mutex_unlock(&map->f_lock);
+    spin_unlock_irqrestore(&map->index_lock, flags);
+}
+
+/**
+ * snap_aio_done releases the resources of a write of the data file once it has completed, possibly in interrupt context.
+ */
+static void snap_aio_done(struct snap_aio *aio, long ret) {
+    struct snap_map *map = aio->map;
+    struct snap_record *r = aio->record;
+    if (ret != r->len) {
+        pr_err("write failed to save sectors [%llu, %llu) of device %d:%d, got %ld",
+               r->header.sector, r->header.sector + r->header.nbytes / 512, MAJOR(map->device), MINOR(map->device), ret);
+    } else {
+        snap_map_index_add(map, &r->header, aio->pos);
+        stats_add(STAT_SAVED_BYTES, r->header.nbytes);
+    }
+    latency_record(map->device, LAT_WRITE, aio->started_ns);
+    snap_record_free(r);
+    block_work_put(aio->owner);
+    kfree(aio);
+    // submit_work gives up when it finds SNAP_MAX_INFLIGHT writes in flight, the write that frees the first slot requeues it
+    if (atomic_dec_return(&map->inflight) == SNAP_MAX_INFLIGHT - 1) {
+        snap_map_kick(map);
+    }
+    snap_map_put(map);
+}
+
+/**
+ * snap_aio_complete is called when a queued write of the data file completes, the freeze protection taken by
+ * vfs_iocb_iter_write is released here.
+ */
+static void snap_aio_complete(struct kiocb *iocb, long ret) {
+    kiocb_end_write(iocb);
+    snap_aio_done(container_of(iocb, struct snap_aio, iocb), ret);
+}
+
+/**
+ * snap_aio_submit appends the record of aio to the data file of its map, the header and the sectors are submitted as a single
+ * vectored write. It is called only by submit_work, so the records of a map reserve their space in the order they were queued.
+ */
+static void snap_aio_submit(struct snap_aio *aio) {
+    struct snap_map *map = aio->map;
+    struct snap_record *r = aio->record;
+    iov_iter_bvec(&aio->iter, ITER_SOURCE, r->bvec, r->nr_bvecs, r->len);
+    struct file *f = map->f_data;
+    init_sync_kiocb(&aio->iocb, f);
+    aio->iocb.ki_flags |= IOCB_WRITE;
+    aio->iocb.ki_complete = snap_aio_complete;
+    aio->pos = atomic64_fetch_add(r->len, &map->f_end);
+    aio->iocb.ki_pos = aio->pos;
+    snap_map_prealloc(map, aio->pos + r->len);
+    // vfs_iocb_iter_write checks the file mode and the range, and holds the freeze protection of the file system while the
+    // write is in flight. A queued write calls snap_aio_complete by itself, aio must not be touched anymore
+    ssize_t ret = vfs_iocb_iter_write(f, &aio->iocb, &aio->iter);
+    if (ret != -EIOCBQUEUED) {
+        snap_aio_done(aio, ret);
+    }
+}
+
+/**
+ * snap_map_submit_work drains the writes queued to map. A buffered write, as well as a direct one that extends the file, is
+ * completed before vfs_iocb_iter_write returns, so only this work waits for them: save_block never does. When map has
+ * SNAP_MAX_INFLIGHT writes in flight the work returns, the completion that frees a slot queues it again.
+ */
+static void snap_map_submit_work(struct work_struct *work) {
+    struct snap_map *map = container_of(work, struct snap_map, submit_work);
+    for (;;) {
+        if (!map->ready) {
+            map->ready = llist_reverse_order(llist_del_all(&map->pending));
+            if (!map->ready) {
+                break;
+            }
+        }
+        if (!atomic_add_unless(&map->inflight, 1, SNAP_MAX_INFLIGHT)) {
+            break;
+        }
+        struct snap_aio *aio = llist_entry(map->ready, struct snap_aio, node);
+        map->ready = map->ready->next;
+        snap_aio_submit(aio);
+        cond_resched();
+    }
+    snap_map_put(map);
+}
+
+/**
+ * snap_map_write queues to map a write of the sectors [first, last_excl) of the data read by owner (relative to the first sector
+ * read) as an extent record. It doesn't wait: the record is submitted by the submit_work of map.
+ */
+static void snap_map_write(struct snap_map *map, struct block_work *owner, unsigned long first, unsigned long last_excl) {
+    u64 started_ns = ktime_get_ns();
+    struct snap_aio *aio = kzalloc(sizeof(*aio), GFP_NOIO);
+    if (!aio) {
+        goto no_memory;
+    }
+    aio->started_ns = started_ns;
+    aio->record = snap_record_alloc(map, owner->p_data, first, last_excl);
+    if (!aio->record) {
+        kfree(aio);
+        goto no_memory;
+    }
+    kref_get(&map->ref);
+    atomic_inc(&owner->ref);
+    aio->map = map;
+    aio->owner = owner;
+    llist_add(&aio->node, &map->pending);
+    snap_map_kick(map);
+    return;
+
+no_memory:
+    stats_inc(STAT_ALLOC_FAILURES);
+    pr_err("out of memory");
 }
 
 static struct snap_map *snap_map_lookup_srcu(dev_t dev, struct timespec64 *created_on) {
@@ -399,44 +1149,33 @@ static struct snap_map *snap_map_lookup_srcu(dev_t dev, struct timespec64 *creat
     return NULL;
 }
 
+/**
+ * save_block writes each run of sectors read by a read bio that weren't already preserved by the session as a single record.
+ * The pages read are released when the last write completes.
+ */
 static void save_block(struct work_struct *work) {
     struct block_work *w = container_of(work, struct block_work, work);
-    unsigned long sectors_num = DIV_ROUND_UP(w->data.len, 512);
-    struct small_bitmap s_map;
-    unsigned long *added = small_bitmap_zeros(&s_map, sectors_num);
-    if (!added) {
-        goto out;
-    }
-    
+    stats_dec(STAT_SAVE_BLOCKS_QUEUED);
+    struct bio_private_data *p_data = w->p_data;
+    latency_record(p_data->dev, LAT_SAVE_QUEUE, w->queued_ns);
     int rdx = srcu_read_lock(&srcu);
-    struct snap_map *map = snap_map_lookup_srcu(w->device, &w->session_created_on);
+    struct snap_map *map = snap_map_lookup_srcu(p_data->dev, &w->session_created_on);
     if (!map) {
-        goto out2;
-    }
-    unsigned long lo = w->sector;
-    unsigned long hi_excl = w->sector + sectors_num;
-    int err = rbitmap32_add_range(&map->bitmap, lo, hi_excl, added);
-    if (err) {
-        pr_err("cannot add range [%lu, %lu) to bitmap, got error %d", lo, hi_excl, err);
-        goto out2;
+        goto out;
     }
-    
-    lo = 0;
-    unsigned long hi;
-    while (small_bitmap_next_set_region(&s_map, &lo, &hi)) {
-        snap_map_write(map, &w->data, lo * 512, (hi - lo) * 512, w->sector +  lo);
-        lo = hi;
+    unsigned long first = 0;
+    unsigned long last_excl;
+    while (small_bitmap_next_set_region(&w->added, &first, &last_excl)) {
+        snap_map_write(map, w, first, last_excl);
+        first = last_excl;
     }
 
-out2:
-    srcu_read_unlock(&srcu, rdx);
-    small_bitmap_free(&s_map);
 out:
-    __free_pages(w->data.page, get_order(w->data.len));
-    kfree(w);
+    srcu_read_unlock(&srcu, rdx);
+    block_work_put(w);
 }
 
-static struct file* try_create_file(const char *session_id, const char *name) {
+static struct file* try_create_file(const char *session_id, const char *name, int flags) {
     char *buf = kzalloc(PATH_MAX, GFP_KERNEL);
     if (!buf) {
         return ERR_PTR(-ENOMEM);
@@ -456,7 +1195,7 @@ static struct file* try_create_file(const char *session_id, const char *name) {
         return ERR_PTR(-ENOMEM);
     }
     sprintf(path, "%s/%s", parent, name);
-    struct file *fp = filp_open(path, O_CREAT | O_WRONLY | O_APPEND, 0600);
+    struct file *fp = filp_open(path, flags, 0600);
     if (IS_ERR(fp)) {
         pr_err("cannot open file %s got error %ld (%s)", path, PTR_ERR(fp), errtoa(PTR_ERR(fp)));
     }
@@ -465,6 +1204,49 @@ static struct file* try_create_file(const char *session_id, const char *name) {
     return fp;
 }
 
+/**
+ * snap_map_dio_align reads the alignment that direct I/O requires to the file f. It returns 0 on success, <0 otherwise.
+ */
+static int snap_map_dio_align(struct snap_map *map, struct file *f) {
+    struct kstat stat;
+    int err = vfs_getattr(&f->f_path, &stat, STATX_DIOALIGN, AT_STATX_SYNC_AS_STAT);
+    if (err) {
+        return err;
+    }
+    if (!(stat.result_mask & STATX_DIOALIGN) || !stat.dio_offset_align) {
+        return -EOPNOTSUPP;
+    }
+    // the head of a record is a single aligned block, at least a sector long, that holds its snap_rec_header, and the bounce
+    // pages must be aligned
+    unsigned int align = max_t(unsigned int, stat.dio_offset_align, 512);
+    if (!is_power_of_2(align) || align > PAGE_SIZE) {
+        return -EOPNOTSUPP;
+    }
+    map->align = align;
+    map->mem_align = max_t(unsigned int, stat.dio_mem_align, 1);
+    return 0;
+}
+
+/**
+ * snap_map_open_direct opens the data file with O_DIRECT and enables preallocation from the first aligned offset past the end of
+ * the file. It returns NULL if the filesystem doesn't support direct I/O.
+ */
+static struct file *snap_map_open_direct(struct snap_map *map, const char *session_id) {
+    struct file *f = try_create_file(session_id, "data", O_CREAT | O_WRONLY | O_DIRECT);
+    if (IS_ERR(f)) {
+        return NULL;
+    }
+    int err = snap_map_dio_align(map, f);
+    if (err) {
+        pr_warn("cannot use direct I/O for session %s, got error %d", session_id, err);
+        filp_close(f, NULL);
+        return NULL;
+    }
+    map->prealloc_end = round_up(i_size_read(file_inode(f)), map->align);
+    map->prealloc = true;
+    return f;
+}
+
 static struct snap_map* snap_map_alloc(const char *session_id, dev_t dev, struct timespec64 *created_on) {
     struct snap_map *map;
     map = kzalloc(sizeof(*map), GFP_KERNEL);
@@ -473,20 +1255,33 @@ static struct snap_map* snap_map_alloc(const char *session_id, dev_t dev, struct
     }
     map->device = dev;
     memcpy(&map->session_created_on, created_on, sizeof(struct timespec64));
-    int err = rbitmap32_init(&map->bitmap);
-    if (err) {
-        goto out;
+    struct file *f_data = NULL;
+    if (direct_io) {
+        f_data = snap_map_open_direct(map, session_id);
+    }
+    if (!f_data) {
+        map->align = 1;
+        map->mem_align = 1;
+        f_data = try_create_file(session_id, "data", O_CREAT | O_WRONLY);
     }
-    struct file *f_data = try_create_file(session_id, "data");
     if (IS_ERR(f_data)) {
-        goto out2;
+        goto out;
     }
     map->f_data = f_data;
-    mutex_init(&map->f_lock);
+    // a file that isn't empty gets a new segment, the first extent follows the superblock
+    map->segment = round_up(i_size_read(file_inode(f_data)), snap_map_rec_align(map));
+    size_t sb_len = round_up(sizeof(struct snap_rec_header) + sizeof(struct snap_superblock), snap_map_rec_align(map));
+    atomic64_set(&map->f_end, map->segment + sb_len);
+    mutex_init(&map->prealloc_lock);
+    spin_lock_init(&map->index_lock);
+    INIT_LIST_HEAD(&map->index);
+    kref_init(&map->ref);
+    atomic_set(&map->inflight, 0);
+    init_llist_head(&map->pending);
+    INIT_WORK(&map->submit_work, snap_map_submit_work);
+    atomic_inc(&live_maps);
     return map;
 
-out2:
-    rbitmap32_destroy(&map->bitmap);
 out:
     kfree(map);
     return NULL;
@@ -507,13 +1302,22 @@ static int try_snap_map_create(const char *session_id, dev_t dev, struct timespe
         }
     }
     if (!found) {
+        // the superblock is written outside of the lock, meanwhile the map could be destroyed
+        kref_get(&map->ref);
         list_add_rcu(&map->list, &map_list);
     }
     spin_unlock(&write_lock);
     if (found) {
+        // the space past the end of the file belongs to the map that won the race
+        map->prealloc = false;
         snap_map_free(map);
         return -EEXIST;
     }
+    int err = snap_map_write_super(map);
+    if (err) {
+        pr_err("cannot write the superblock of device %d:%d, got error %d", MAJOR(dev), MINOR(dev), err);
+    }
+    snap_map_put(map);
     return 0;
 }
 
@@ -534,86 +1338,125 @@ static int snap_map_create(const char *session_id, dev_t dev, struct timespec64
 }
 
 /**
- * snapshot_save submit the original bio and schedules each page or compound one of bio to the workqueue. Each page
- * will be saved to /snapshots/<session id>/<sector no>
+ * resubmit_bio submits a write bio intercepted by the kprobe from the work item that owns it.
+ */
+static inline void resubmit_bio(struct bio **resubmitting, struct bio *bio) {
+    *resubmitting = bio;
+    submit_bio(bio);
+    *resubmitting = NULL;
+}
+
+/**
+ * snapshot_resubmit submits the original bio of w, if it hasn't been submitted yet.
+ */
+static void snapshot_resubmit(struct file_work *w) {
+    if (!w->orig_bio) {
+        return;
+    }
+    resubmit_bio(&w->resubmitting, w->orig_bio);
+    w->orig_bio = NULL;
+    if (w->p_data) {
+        latency_record(w->p_data->dev, LAT_RESUBMIT, w->p_data->read_completed_ns);
+    }
+}
+
+/**
+ * snapshot_save submit the original bio and schedules all the pages read by the read bio to the workqueue as a single work item.
+ * They will be saved to /snapshots/<session id>/data
+ * The sectors read are added to the session before the original bio is submitted. The writes are processed in order only until
+ * their reads are submitted, the reads complete and the work items of read_bio_wq run in any order, so an overlapping write
+ * intercepted later can read the sectors after the original bio has written them. Such a read is never saved: the sectors are
+ * already in the session when the original bio is submitted, so the later write finds them preserved and drops its copy. The
+ * first copy of a sector added to the session is always read before any intercepted write to that sector is submitted.
+ * If a step fails before the sectors are added, the original bio is submitted anyway and the sectors aren't preserved.
  */
 static void snapshot_save(struct work_struct *work) {
     struct file_work *w = container_of(work, struct file_work, work);
-    submit_bio(w->orig_bio);
-    if (!w->p_data) {
+    struct bio_private_data *p_data = w->p_data;
+    stats_dec(STAT_READ_BIO_QUEUED);
+    if (!p_data) {
+        snapshot_resubmit(w);
+        work_pool_free(&file_work_pool, w);
         return;
     }
     size_t dirname_len = get_dirname_len();
     char *dirname = kzalloc(dirname_len + 1, GFP_KERNEL);
     if (!dirname) {
+        stats_inc(STAT_ALLOC_FAILURES);
         pr_err("out of memory");
         goto out;
     }
-    struct bio_private_data *p_data = w->p_data;
     struct timespec64 session_created_on;
     if (!registry_session_id(p_data->dev, &w->read_completed_on, dirname, dirname_len + 1, &session_created_on)) {
         pr_err("snapshot_save: no session associated to device %d:%d", MAJOR(p_data->dev), MINOR(p_data->dev));
         goto free_session;
     }
 
-    // We completed successfully the read of the region to snapshot, so we
-    // can add the whole range to the tree.
-    struct b_range *range = b_range_alloc(p_data->sector, p_data->sector + DIV_ROUND_UP(p_data->bytes, 512));
-    if (!range) {
+    // it can't fail: the allocation waits for a reserved item if the slab allocator runs out of memory
+    struct block_work *b = work_pool_zalloc(&block_work_pool, GFP_NOIO);
+    // We completed successfully the read of the regions to snapshot, so we can add them to the session, only the sectors it
+    // didn't preserve yet must be saved
+    unsigned long sectors_num = DIV_ROUND_UP(p_data->bytes, 512);
+    unsigned long *added = (unsigned long *)small_bitmap_zeros(&b->added, sectors_num);
+    if (!added) {
+        stats_inc(STAT_ALLOC_FAILURES);
         pr_err("out of memory");
-        goto free_session;
+        goto free_work;
+    }
+    int i = 0;
+    unsigned long first, last_excl;
+    unsigned long read_sectors = 0;
+    while (page_iter_next_region(p_data, &i, &first, &last_excl)) {
+        read_sectors += last_excl - first;
+        int err = registry_add_range(p_data->dev, &session_created_on, p_data->sector + first, p_data->sector + last_excl, added, first);
+        if (err) {
+            pr_err("cannot add range [%llu, %llu) to session of device %d:%d, got error %d",
+                   p_data->sector + first, p_data->sector + last_excl, MAJOR(p_data->dev), MINOR(p_data->dev), err);
+        }
     }
-    int err = registry_add_range(p_data->dev, &session_created_on, range);
-    if (err) {
-        kfree(range);
+    snapshot_resubmit(w);
+    // the sectors read that another write preserved in the meantime are dropped
+    stats_add(STAT_DEDUP_BYTES, (read_sectors - bitmap_weight(added, sectors_num)) * 512);
+    if (bitmap_empty(added, sectors_num)) {
+        goto free_work;
     }
 
-    err = snap_map_create(dirname, p_data->dev, &session_created_on);
+    int err = snap_map_create(dirname, p_data->dev, &session_created_on);
     if (err && err != -EEXIST) {
         pr_err("cannot create bitmap, got error %d", err);
-        goto free_session;
+        goto free_work;
     }
 
-    sector_t sector = p_data->sector;
-    struct page_iter *pos;
-    page_iter_for_each(pos, p_data) {
-        struct block_work *b;
-        b = kzalloc(sizeof(*b) + get_dirname_len() + 1, GFP_KERNEL);
-        if (!b) {
-            pr_err("out of memory");
-            break;
-        }
-        b->device = p_data->dev;
-        b->sector = sector;
-        memcpy(b->session_id, dirname, get_dirname_len());
-        memcpy(&b->session_created_on, &session_created_on, sizeof(session_created_on));
-        memcpy(&b->data, pos, sizeof(*pos));
-        INIT_WORK(&b->work, save_block);
-        queue_work(save_blocks_wq, &b->work);
-        sector += DIV_ROUND_UP(pos->len, 512);
-    }
+    b->p_data = p_data;
+    atomic_set(&b->ref, 1);
+    memcpy(&b->session_created_on, &session_created_on, sizeof(session_created_on));
+    INIT_WORK(&b->work, save_block);
+    b->queued_ns = ktime_get_ns();
+    stats_inc(STAT_SAVE_BLOCKS_QUEUED);
+    queue_work(save_blocks_wq, &b->work);
     kfree(dirname);
-    kfree(w);
+    work_pool_free(&file_work_pool, w);
     return;
 
+free_work:
+    small_bitmap_free(&b->added);
+    work_pool_free(&block_work_pool, b);
 free_session:
     kfree(dirname);
 out:
+    snapshot_resubmit(w);
     bio_private_data_destroy(p_data);
-    kfree(w);
+    work_pool_free(&file_work_pool, w);
 }
 
-static void read_bio_enqueue(struct bio *orig_bio, struct bio_private_data *p_data) {
-    struct file_work *w;
-    w = kzalloc(sizeof(*w), GFP_ATOMIC);
-    if (!w) {
-        pr_err("out of memory");
-        return;
-    }
-    w->orig_bio = orig_bio;
-    w->p_data = p_data;
+/**
+ * read_bio_enqueue schedules the work item allocated by create_read_bios, so the original bio is always submitted even if the
+ * system runs out of memory when the read completes.
+ */
+static void read_bio_enqueue(struct file_work *w) {
     ktime_get_real_ts64(&w->read_completed_on);
     INIT_WORK(&w->work, snapshot_save);
+    stats_inc(STAT_READ_BIO_QUEUED);
     queue_work(read_bio_wq, &w->work);
 }
 
@@ -623,127 +1466,227 @@ static void read_bio_enqueue(struct bio *orig_bio, struct bio_private_data *p_da
  * submit_bio can call schedule().
  */
 static void read_original_block_end_io(struct bio *bio) {
-    struct bio_private_data *p_data = (struct bio_private_data*)bio->bi_private;
-    struct bio *orig_bio = p_data->orig_bio;
+    struct file_work *w = bio->bi_private;
+    struct bio_private_data *p_data = w->p_data;
+    latency_record(p_data->dev, LAT_READ, p_data->read_submitted_ns);
+    p_data->read_completed_ns = ktime_get_ns();
     if (bio->bi_status != BLK_STS_OK) {
         pr_err("bio completed with error %d", bio->bi_status);
         bio_private_data_destroy(p_data);
-        p_data = NULL;
+        w->p_data = NULL;
+    } else {
+        unsigned long bytes = 0;
+        struct page_iter *pos;
+        page_iter_for_each(pos, p_data) {
+            bytes += pos->len;
+        }
+        stats_add(STAT_COW_READ_BYTES, bytes);
     }
-    read_bio_enqueue(orig_bio, p_data);
+    read_bio_enqueue(w);
     bio_put(bio);
 }
 
 /**
- * add_page adds pages to the read bio and its private data, the former needs the pages to write the data it reads from disk, the
- * latter save the page content in the /snapshots directory.
+ * add_page allocates the pages that hold the bytes [start, start + len) of the written range, offset is the offset of the first
+ * byte in the first page. They are added to the read bio and to its private data, the former needs the pages to write the data
+ * it reads from disk, the latter save the page content in the /snapshots directory. The pages are handed as they are to the data
+ * file of the session by save_block, and they aren't zeroed because a successful read overwrites all the bytes that are saved.
  */
-static inline int add_page(struct bio_vec *bvec, struct bio *bio) {
-    struct bio_private_data *p = bio->bi_private;
-    if (p->iter_len > p->iter_capacity) {
+static inline int add_page(struct bio *bio, struct bio_private_data *p, unsigned long start, unsigned int offset, unsigned int len) {
+    if (p->iter_len >= p->iter_capacity) {
         pr_err("cannot add page to bio's private data: max number of page(s) is %lu", p->iter_capacity);
-        return 0;
+        return -ENOSPC;
     }
 
-    struct page *page = alloc_pages(GFP_KERNEL | __GFP_ZERO, get_order(bvec->bv_len));
+    unsigned int order = page_iter_order(offset, len);
+    struct page *page = alloc_pages(GFP_KERNEL, order);
     if (!page) {
+        stats_inc(STAT_ALLOC_FAILURES);
         pr_err("out of memory");
         return -ENOMEM;
     }
     
-    int err = bio_add_page(bio, page, bvec->bv_len, bvec->bv_offset);
-    if (err != bvec->bv_len) {
+    if (bio_add_page(bio, page, len, offset) != len) {
         pr_err("bio_add_page failed");
-        __free_pages(page, get_order(bvec->bv_len));
-        return 0;
+        __free_pages(page, order);
+        return -EIO;
     }
-    p->iter[p->iter_len].len = bvec->bv_len;
-    p->iter[p->iter_len].offset = bvec->bv_offset;
+    p->iter[p->iter_len].start = start;
+    p->iter[p->iter_len].len = len;
+    p->iter[p->iter_len].offset = offset;
     p->iter[p->iter_len++].page = page;
-    p->bytes += bvec->bv_len;
-    return bvec->bv_len;
+    return 0;
 }
 
-static int allocate_pages(struct bio *bio, struct bio *orig_bio) {
+/**
+ * create_gap_bio creates a read request of the sectors [first, last_excl) written by orig_bio (relative to its first sector),
+ * its pages follow the layout of the bio_vec(s) of orig_bio.
+ */
+static struct bio *create_gap_bio(struct bio *orig_bio, struct bio_private_data *p_data, unsigned long first, unsigned long last_excl) {
+    struct bio *bio = bio_alloc(orig_bio->bi_bdev, orig_bio->bi_vcnt, REQ_OP_READ, GFP_KERNEL);
+    if (!bio) {
+        stats_inc(STAT_ALLOC_FAILURES);
+        pr_err("bio_alloc failed");
+        return NULL;
+    }
+    bio->bi_iter.bi_sector = p_data->sector + first;
+    unsigned long lo = first * 512;
+    unsigned long hi = min(last_excl * 512, p_data->bytes);
+    unsigned long start = 0;
     struct bio_vec bvec;
-	struct bvec_iter it;
+    struct bvec_iter it;
     bio_for_each_bvec(bvec, orig_bio, it) {
-        if (add_page(&bvec, bio) != bvec.bv_len) {
-            goto out;
+        unsigned long end = start + bvec.bv_len;
+        if (end > lo && start < hi) {
+            unsigned long from = max(start, lo);
+            unsigned long to = min(end, hi);
+            if (add_page(bio, p_data, from, offset_in_page(bvec.bv_offset + (from - start)), to - from)) {
+                bio_put(bio);
+                return NULL;
+            }
         }
+        start = end;
     }
-    return 0;
-
-out:
-    free_all_pages((struct bio_private_data*)bio->bi_private);
-    return -1;
+    return bio;
 }
 
 /**
- * create_read_bio creates a read request of the block IO layer. This request has a callback that schedules the original
- * write bio after the targeted region has been read from the block device
+ * create_read_bios creates the read requests of the sectors written by orig_bio that the session didn't preserve yet, one for each
+ * run of those sectors, so the I/O and the pages allocated don't depend on the sectors already preserved. The requests are chained
+ * to the first one, whose callback schedules the original write bio after all the runs have been read. They are added to bios,
+ * which is left empty if every sector has been preserved in the meantime. It returns 0 on success, <0 otherwise.
+ * The work item that submits the original bio after the reads is allocated here, where it is allowed to wait for a reserved
+ * item, rather than in the callback of the reads which runs in atomic context.
  */
-static struct bio* create_read_bio(struct bio *orig_bio) {
+static int create_read_bios(struct bio *orig_bio, struct bio_list *bios) {
+    unsigned long bytes = orig_bio->bi_iter.bi_size;
+    unsigned long sectors_num = DIV_ROUND_UP(bytes, 512);
+    sector_t sector = orig_bio->bi_iter.bi_sector;
+    struct small_bitmap gaps;
+    if (!small_bitmap_zeros(&gaps, sectors_num)) {
+        stats_inc(STAT_ALLOC_FAILURES);
+        pr_err("out of memory");
+        return -ENOMEM;
+    }
+    int err = 0;
+    long n = registry_lookup_gaps(orig_bio->bi_bdev->bd_dev, sector, sector + sectors_num, (unsigned long *)gaps.map);
+    // the session could have been destroyed after the write was intercepted, then there is nothing to save
+    if (n <= 0) {
+        goto out;
+    }
+    int nr_gaps = 0;
+    unsigned long first = 0;
+    unsigned long last_excl;
+    while (small_bitmap_next_set_region(&gaps, &first, &last_excl)) {
+        ++nr_gaps;
+        first = last_excl;
+    }
+
+    // every run can split a bio_vec of orig_bio in two
     struct bio_private_data *p_data;
-    p_data = kzalloc(sizeof(*p_data) + sizeof(struct page_iter) * orig_bio->bi_vcnt, GFP_KERNEL);
+    p_data = kzalloc(struct_size(p_data, iter, orig_bio->bi_vcnt + nr_gaps), GFP_KERNEL);
     if (!p_data) {
+        stats_inc(STAT_ALLOC_FAILURES);
         pr_err("out of memory");
-        return NULL;
+        err = -ENOMEM;
+        goto out;
     }
     p_data->orig_bio = orig_bio;
     p_data->dev = orig_bio->bi_bdev->bd_dev;
-    p_data->iter_capacity = orig_bio->bi_vcnt;
-    sector_t sector = orig_bio->bi_iter.bi_sector;
+    p_data->iter_capacity = orig_bio->bi_vcnt + nr_gaps;
     p_data->sector = sector;
-    struct bio *read_bio = bio_alloc(orig_bio->bi_bdev, orig_bio->bi_vcnt, REQ_OP_READ, GFP_KERNEL);
-    if (!read_bio) {
-        pr_err("bio_alloc failed");
-        goto no_bio;
-    }
-    read_bio->bi_end_io = read_original_block_end_io;
-    read_bio->bi_iter.bi_sector = sector;
-    read_bio->bi_private = p_data;
-    if (allocate_pages(read_bio, orig_bio)) {
-        pr_err("cannot allocate pages for read bio");
-        goto no_pages;
+    p_data->bytes = bytes;
+    first = 0;
+    while (small_bitmap_next_set_region(&gaps, &first, &last_excl)) {
+        struct bio *bio = create_gap_bio(orig_bio, p_data, first, last_excl);
+        if (!bio) {
+            pr_err("cannot create read bio of sectors [%llu, %llu)", sector + first, sector + last_excl);
+            err = -ENOMEM;
+            goto no_bio;
+        }
+        bio_list_add(bios, bio);
+        first = last_excl;
     }
-    return read_bio;
+    // it can't fail: the allocation waits for a reserved item if the slab allocator runs out of memory
+    struct file_work *w = work_pool_zalloc(&file_work_pool, GFP_NOIO);
+    w->orig_bio = orig_bio;
+    w->p_data = p_data;
+    struct bio *parent = bio_list_peek(bios);
+    parent->bi_end_io = read_original_block_end_io;
+    parent->bi_private = w;
+    for (struct bio *bio = parent->bi_next; bio; bio = bio->bi_next) {
+        bio_chain(bio, parent);
+    }
+    p_data->read_submitted_ns = ktime_get_ns();
+    goto out;
 
-no_pages:
-    bio_put(read_bio);
 no_bio:
-    kfree(p_data);
-    return NULL;
+    for (struct bio *bio = bio_list_pop(bios); bio; bio = bio_list_pop(bios)) {
+        bio_put(bio);
+    }
+    bio_private_data_destroy(p_data);
+out:
+    small_bitmap_free(&gaps);
+    return err;
 }
 
 /**
- * process_bio creates a read bio that targets the area involved in the write request (orig_bio).
+ * process_bio reads the regions of the device involved in the write request (orig_bio) that haven't been preserved yet, the
+ * original bio is submitted right away if there is none.
  */
 static void process_bio(struct work_struct *work) {
     struct write_bio_work *w = container_of(work, struct write_bio_work, work);
     struct bio *orig_bio = w->orig_bio;
-    pr_info("processing bio %llu #%u B", orig_bio->bi_iter.bi_sector, orig_bio->bi_iter.bi_size);
-    struct bio *read_bio = create_read_bio(orig_bio);
-    if (read_bio) {
-        submit_bio(read_bio);
+    stats_dec(STAT_WRITE_BIO_QUEUED);
+    if (!latency_dev_add(orig_bio->bi_bdev->bd_dev)) {
+        latency_record(orig_bio->bi_bdev->bd_dev, LAT_QUEUE, w->intercepted_ns);
+    }
+    pr_debug(pr_format("processing bio %llu #%u B"), orig_bio->bi_iter.bi_sector, orig_bio->bi_iter.bi_size);
+    struct bio_list bios;
+    bio_list_init(&bios);
+    if (create_read_bios(orig_bio, &bios) || bio_list_empty(&bios)) {
+        resubmit_bio(&w->resubmitting, orig_bio);
     } else {
-        submit_bio(orig_bio);
+        struct bio *bio;
+        while ((bio = bio_list_pop(&bios))) {
+            submit_bio(bio);
+        }
+    }
+    work_pool_free(&write_bio_work_pool, w);
+}
+
+/**
+ * snapshot_is_resubmitting returns true if bio is a write bio that has been intercepted by the kprobe and that is being submitted
+ * by the work item that owns it. Only the workers of the module are checked, the test is a single branch for any other task.
+ */
+bool snapshot_is_resubmitting(struct bio *bio) {
+    struct work_struct *work = current_work();
+    if (!work) {
+        return false;
+    }
+    if (work->func == process_bio) {
+        return container_of(work, struct write_bio_work, work)->resubmitting == bio;
+    }
+    if (work->func == snapshot_save) {
+        return container_of(work, struct file_work, work)->resubmitting == bio;
     }
-    kfree(w);
+    return false;
 }
 
 /**
- * write_bio_enqueue schedules a (write) bio for deferred work.
+ * write_bio_enqueue schedules a (write) bio for deferred work, intercepted_ns is when the bio has been intercepted (ktime_get_ns).
  */
-int write_bio_enqueue(struct bio *bio) {
-    struct write_bio_work *w;
-    w = kzalloc(sizeof(*w), GFP_ATOMIC);
+int write_bio_enqueue(struct bio *bio, u64 intercepted_ns) {
+    struct write_bio_work *w = work_pool_zalloc(&write_bio_work_pool, GFP_ATOMIC);
     if (!w) {
+        stats_inc(STAT_ALLOC_FAILURES);
         pr_err("out of memory");
         return -ENOMEM;
     }
     w->orig_bio = bio;
+    w->intercepted_ns = intercepted_ns;
     INIT_WORK(&w->work, process_bio);
-    queue_work(write_bio_wq, &w->work);
+    stats_inc(STAT_WRITE_BIO_QUEUED);
+    queue_work(write_bio_wq_of(bio->bi_bdev->bd_dev), &w->work);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include "stats.h"
+#include "probes.h"
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/printk.h>
+#include <linux/seq_file.h>
+#include <linux/sprintf.h>
+
+#define DEBUGFS_DIR "bsnapshot"
+
+DEFINE_PER_CPU(struct snap_stats, snap_stats);
+
+static const char *const stat_names[STAT_NR_ITEMS] = {
+    [STAT_INTERCEPTED]        = "intercepted",
+    [STAT_SKIPPED]            = "skipped",
+    [STAT_DEFERRED]           = "deferred",
+    [STAT_COW_READ_BYTES]     = "cow_read_bytes",
+    [STAT_SAVED_BYTES]        = "saved_bytes",
+    [STAT_DEDUP_BYTES]        = "dedup_bytes",
+    [STAT_ALLOC_FAILURES]     = "alloc_failures",
+    [STAT_WRITE_BIO_QUEUED]   = "write_bio_wq_depth",
+    [STAT_READ_BIO_QUEUED]    = "read_bio_wq_depth",
+    [STAT_SAVE_BLOCKS_QUEUED] = "save_blocks_wq_depth",
+};
+
+static struct dentry *debugfs_dir;
+
+/**
+ * stats_sum returns the sum over the possible CPUs of the counter item. The counters are read without synchronization, so the
+ * sum of a gauge can be briefly off by the work items that are being queued or started.
+ */
+static s64 stats_sum(enum stat_item item) {
+    s64 sum = 0;
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        sum += READ_ONCE(per_cpu(snap_stats, cpu).items[item]);
+    }
+    return sum;
+}
+
+/**
+ * stats_show prints into buf a line "<name> <value>" for each counter followed by the number of hits missed by the kprobe and by
+ * the kretprobes. It returns the number of bytes written.
+ */
+ssize_t stats_show(char *buf, size_t size) {
+    ssize_t br = 0;
+    for (int i = 0; i < STAT_NR_ITEMS; ++i) {
+        br += scnprintf(&buf[br], size - br, "%s %lld\n", stat_names[i], stats_sum(i));
+    }
+    br += scnprintf(&buf[br], size - br, "kprobe_misses %lu\n", probes_kprobe_nmissed());
+    br += scnprintf(&buf[br], size - br, "kretprobe_misses %lu\n", probes_kretprobe_nmissed());
+    return br;
+}
+
+static int stats_seq_show(struct seq_file *m, void *v) {
+    for (int i = 0; i < STAT_NR_ITEMS; ++i) {
+        seq_printf(m, "%s %lld\n", stat_names[i], stats_sum(i));
+    }
+    seq_printf(m, "kprobe_misses %lu\n", probes_kprobe_nmissed());
+    seq_printf(m, "kretprobe_misses %lu\n", probes_kretprobe_nmissed());
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(stats_seq);
+
+/**
+ * stats_init creates the debugfs directory of the module and the file stats inside it. The module works without them, so a
+ * failure of debugfs is only reported.
+ */
+void stats_init(void) {
+    debugfs_dir = debugfs_create_dir(DEBUGFS_DIR, NULL);
+    if (IS_ERR(debugfs_dir)) {
+        pr_warn("cannot create debugfs directory %s, got error %ld", DEBUGFS_DIR, PTR_ERR(debugfs_dir));
+        debugfs_dir = NULL;
+        return;
+    }
+    debugfs_create_file("stats", 0440, debugfs_dir, NULL, &stats_seq_fops);
+}
+
+void stats_cleanup(void) {
+    debugfs_remove_recursive(debugfs_dir);
+    debugfs_dir = NULL;
+}
+
+/**
+ * stats_debugfs_dir returns the debugfs directory of the module, or NULL if it couldn't be created.
+ */
+struct dentry *stats_debugfs_dir(void) {
+    return debugfs_dir;
+}
@@ -0,0 +1,48 @@
+#include "watched.h"
+#include "pr_format.h"
+#include <linux/bitmap.h>
+#include <linux/printk.h>
+#include <linux/string.h>
+
+unsigned long watched_devices[BITS_TO_LONGS(1 << WATCHED_BITS)] __read_mostly;
+
+// number of devices that hash to each bit of the filter, it makes deletions possible
+static u16 watched_refs[1 << WATCHED_BITS];
+
+static void watched_get(u32 bit) {
+    if (watched_refs[bit]++ == 0) {
+        set_bit(bit, watched_devices);
+    }
+}
+
+static void watched_put(u32 bit) {
+    if (!watched_refs[bit]) {
+        pr_err("unbalanced reference count of bit %u", bit);
+        return;
+    }
+    if (--watched_refs[bit] == 0) {
+        clear_bit(bit, watched_devices);
+    }
+}
+
+/**
+ * watched_add adds the device number dev to the filter. The callers must serialize the updates, the registry
+ * does it by calling this function while holding its spinlock.
+ */
+void watched_add(dev_t dev) {
+    watched_get(watched_hash1(dev));
+    watched_get(watched_hash2(dev));
+}
+
+/**
+ * watched_del removes the device number dev from the filter, dev must have been added before by watched_add.
+ */
+void watched_del(dev_t dev) {
+    watched_put(watched_hash1(dev));
+    watched_put(watched_hash2(dev));
+}
+
+void watched_reset(void) {
+    bitmap_zero(watched_devices, 1 << WATCHED_BITS);
+    memset(watched_refs, 0, sizeof(watched_refs));
+}
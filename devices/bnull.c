@@ -4,13 +4,38 @@
 #include <linux/blkdev.h>
 #include <linux/blk-mq.h>
 #include <linux/fs.h>
+#include <linux/percpu.h>
 #include <linux/printk.h>
+#include <linux/slab.h>
 #include <linux/sprintf.h>
+#include <linux/sysfs.h>
+#include <linux/timekeeping.h>
+#include <linux/wait_bit.h>
 
 #define DEV_NAME       "bnull"
 #define BLOCK_MINORS   (1)
 #define BNULL_CAPACITY (1024)
 
+/**
+ * bnull_stats counts the dummy bios submitted by a CPU and how many of them were allocated while their hardware queue already had
+ * queue_depth dummy bios in flight. The latter is an upper bound of the bios that waited for a tag: the counter includes the bios
+ * allocated but not yet submitted, so a bio counted there may still have found a free tag.
+ */
+struct bnull_stats {
+    u64 submitted;
+    u64 over_depth;
+};
+
+/**
+ * bnull_bio is a dummy bio allocated from the bio_set of the device, queue is the hardware queue of the CPU that allocated it.
+ */
+struct bnull_bio {
+    bio_end_io_t *end_io;
+    unsigned int  queue;
+    u64           allocated_ns;
+    struct bio    bio;
+};
+
 static struct bnull_dev {
     int                    major;
     int                    first_minor;
@@ -18,6 +43,10 @@ static struct bnull_dev {
     struct gendisk        *gd;
     struct blk_mq_tag_set  tag_set;
     struct request_queue  *queue;
+    struct bio_set         bio_set;
+    // number of dummy bios in flight on each hardware queue
+    atomic_t              *inflight;
+    struct bnull_stats __percpu *stats;
 } dev;
 
 // WARNING: runs in atomic context, so no sleeping allowed
@@ -29,6 +58,97 @@ static blk_status_t null_queue_rq(struct blk_mq_hw_ctx *hctx,
     return BLK_STS_OK;
 }
 
+/**
+ * bnull_bio_end_io calls the callback of the dummy bio and then marks it as completed, so bnull_cleanup doesn't release the
+ * bio_set while the callback can still free the bio.
+ */
+static void bnull_bio_end_io(struct bio *bio) {
+    struct bnull_bio *b = container_of(bio, struct bnull_bio, bio);
+    unsigned int queue = b->queue;
+    b->end_io(bio);
+    if (atomic_dec_and_test(&dev.inflight[queue])) {
+        wake_up_var(dev.inflight);
+    }
+}
+
+/**
+ * bnull_bio_alloc allocates an empty discard request for the bnull device whose callback is end_io, it returns NULL if the device
+ * doesn't exist or the allocation fails. It never sleeps. The bio must be submitted, bnull_cleanup waits for its completion.
+ */
+struct bio *bnull_bio_alloc(bio_end_io_t *end_io, void *private) {
+    struct block_device *bdev = READ_ONCE(dev.bdev);
+    if (!bdev) {
+        return NULL;
+    }
+    struct bio *bio = bio_alloc_bioset(bdev, 0, REQ_OP_DISCARD, GFP_ATOMIC, &dev.bio_set);
+    if (!bio) {
+        return NULL;
+    }
+    struct bnull_bio *b = container_of(bio, struct bnull_bio, bio);
+    int cpu = get_cpu();
+    b->queue = dev.tag_set.map[HCTX_TYPE_DEFAULT].mq_map[cpu];
+    struct bnull_stats *stats = this_cpu_ptr(dev.stats);
+    ++stats->submitted;
+    // the bio may wait for a tag if the queue of this CPU has already a dummy bio per tag
+    if (atomic_inc_return(&dev.inflight[b->queue]) > dev.tag_set.queue_depth) {
+        ++stats->over_depth;
+    }
+    put_cpu();
+    b->end_io = end_io;
+    b->allocated_ns = ktime_get_ns();
+    bio->bi_end_io = bnull_bio_end_io;
+    bio->bi_private = private;
+    return bio;
+}
+
+/**
+ * bnull_bio_allocated_on returns when the dummy bio has been allocated (ktime_get_ns).
+ */
+u64 bnull_bio_allocated_on(struct bio *bio) {
+    return container_of(bio, struct bnull_bio, bio)->allocated_ns;
+}
+
+static void bnull_get_stats(struct bnull_stats *sum) {
+    memset(sum, 0, sizeof(*sum));
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        struct bnull_stats *stats = per_cpu_ptr(dev.stats, cpu);
+        sum->submitted += READ_ONCE(stats->submitted);
+        sum->over_depth += READ_ONCE(stats->over_depth);
+    }
+}
+
+static ssize_t submitted_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct bnull_stats sum;
+    bnull_get_stats(&sum);
+    return sysfs_emit(buf, "%llu\n", sum.submitted);
+}
+
+static ssize_t over_depth_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct bnull_stats sum;
+    bnull_get_stats(&sum);
+    return sysfs_emit(buf, "%llu\n", sum.over_depth);
+}
+
+static DEVICE_ATTR_RO(submitted);
+static DEVICE_ATTR_RO(over_depth);
+
+static struct attribute *bnull_attrs[] = {
+    &dev_attr_submitted.attr,
+    &dev_attr_over_depth.attr,
+    NULL,
+};
+
+static const struct attribute_group bnull_group = {
+    .name = "bnull",
+    .attrs = bnull_attrs,
+};
+
+static const struct attribute_group *bnull_groups[] = {
+    &bnull_group,
+    NULL,
+};
+
 static struct blk_mq_ops qops = {
     .queue_rq = null_queue_rq,
 };
@@ -44,14 +164,18 @@ static void gendisk_delete(struct bnull_dev *dev) {
 }
 
 /**
- * disk_create - creates a disk and adds it to the system.
+ * disk_create - creates a disk and adds it to the system. The disk has a hardware queue of queue_depth tags for each CPU, so the
+ * CPUs that defer writes don't share a tag space. It never needs an I/O scheduler because it completes every request as soon as
+ * it is dispatched. The disk advertises discard support, otherwise submit_bio_noacct would fail the dummy discard bios with
+ * BLK_STS_NOTSUPP before they reach null_queue_rq.
  */
-static int disk_create(struct bnull_dev *blk_dev) {
+static int disk_create(struct bnull_dev *blk_dev, unsigned int queue_depth) {
     blk_dev->tag_set.ops = &qops;
-    blk_dev->tag_set.nr_hw_queues = 1;
-    blk_dev->tag_set.queue_depth = 128;
+    blk_dev->tag_set.nr_hw_queues = nr_cpu_ids;
+    blk_dev->tag_set.queue_depth = clamp_t(unsigned int, queue_depth, 1, BLK_MQ_MAX_DEPTH);
     blk_dev->tag_set.numa_node = NUMA_NO_NODE;
     blk_dev->tag_set.cmd_size = 0;
+    blk_dev->tag_set.flags = BLK_MQ_F_NO_SCHED_BY_DEFAULT;
     blk_dev->tag_set.driver_data = blk_dev;
     int err = blk_mq_alloc_tag_set(&blk_dev->tag_set);
     if (err) {
@@ -59,7 +183,10 @@ static int disk_create(struct bnull_dev *blk_dev) {
         return err;
     }
 
-    struct gendisk *gd = blk_mq_alloc_disk(&blk_dev->tag_set, NULL, blk_dev);
+    struct queue_limits lim = {
+        .max_hw_discard_sectors = UINT_MAX,
+    };
+    struct gendisk *gd = blk_mq_alloc_disk(&blk_dev->tag_set, &lim, blk_dev);
     if (IS_ERR(gd)) {
         err = PTR_ERR(gd);
         pr_err("cannot allocate gendisk for device %s, got error %d", DEV_NAME, err);
@@ -75,7 +202,7 @@ static int disk_create(struct bnull_dev *blk_dev) {
     blk_dev->queue = gd->queue;
     blk_dev->queue->queuedata = blk_dev;
     set_capacity(gd, BNULL_CAPACITY);
-    err = add_disk(gd);
+    err = device_add_disk(NULL, gd, bnull_groups);
     if (err) {
         pr_err("failed to add gendisk for device %s, got error %d", DEV_NAME, err);
         goto out2;
@@ -90,16 +217,36 @@ out:
     return err;
 }
 
-int bnull_init(void) {
+/**
+ * bnull_init creates the bnull device, queue_depth is the number of tags of each hardware queue.
+ */
+int bnull_init(unsigned int queue_depth) {
     memset(&dev, 0, sizeof(dev));
+    int err = -ENOMEM;
+    dev.inflight = kcalloc(nr_cpu_ids, sizeof(*dev.inflight), GFP_KERNEL);
+    if (!dev.inflight) {
+        pr_err("out of memory");
+        return err;
+    }
+    dev.stats = alloc_percpu(struct bnull_stats);
+    if (!dev.stats) {
+        pr_err("out of memory");
+        goto free_inflight;
+    }
+    err = bioset_init(&dev.bio_set, BIO_POOL_SIZE, offsetof(struct bnull_bio, bio), 0);
+    if (err) {
+        pr_err("cannot initialize bio set of %s, got error %d", DEV_NAME, err);
+        goto free_stats;
+    }
     int major = register_blkdev(0, DEV_NAME);
     if (major < 0) {
         pr_err("unable to register %s block device, got error %d", DEV_NAME, major);
-        return major;
+        err = major;
+        goto exit_bioset;
     }
     dev.major = major;
 
-    int err = disk_create(&dev);
+    err = disk_create(&dev, queue_depth);
     if (err) {
         goto unregister_bdev;
     }
@@ -117,14 +264,37 @@ delete_disk:
     gendisk_delete(&dev);
 unregister_bdev:
     unregister_blkdev(dev.major, DEV_NAME);
+exit_bioset:
+    bioset_exit(&dev.bio_set);
+free_stats:
+    free_percpu(dev.stats);
+free_inflight:
+    kfree(dev.inflight);
     return err;
 }
 
+static bool bnull_idle(void) {
+    for (unsigned int i = 0; i < nr_cpu_ids; ++i) {
+        if (atomic_read(&dev.inflight[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * bnull_cleanup destroys the bnull device, the submit_bio kprobe must be already unregistered so no new dummy bio is allocated.
+ * It waits for the callbacks of the dummy bios in flight before it releases the bio_set they come from.
+ */
 void bnull_cleanup() {
+    WRITE_ONCE(dev.bdev, NULL);
+    wait_var_event(dev.inflight, bnull_idle());
+    struct bnull_stats sum;
+    bnull_get_stats(&sum);
+    pr_info("%s: %llu dummy bios, %llu allocated beyond the queue depth", DEV_NAME, sum.submitted, sum.over_depth);
     gendisk_delete(&dev);
     unregister_blkdev(dev.major, DEV_NAME);
-}
-
-struct block_device *bnull_get_bdev(void) {
-    return dev.bdev;
+    bioset_exit(&dev.bio_set);
+    free_percpu(dev.stats);
+    kfree(dev.inflight);
 }
\ No newline at end of file
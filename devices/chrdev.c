@@ -2,6 +2,7 @@
 #include "chrdev.h"
 #include "pr_format.h"
 #include "registry.h"
+#include "stats.h"
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/device/class.h>
@@ -38,8 +39,22 @@ static ssize_t session_show(struct device *dev, struct device_attribute *attr, c
 
 DEVICE_ATTR(active, 0440, session_show, NULL);
 
+static ssize_t extents_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return registry_show_extents(buf, PAGE_SIZE - 1);
+}
+
+DEVICE_ATTR(extents, 0440, extents_show, NULL);
+
+static ssize_t stats_attr_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return stats_show(buf, PAGE_SIZE);
+}
+
+DEVICE_ATTR(stats, 0440, stats_attr_show, NULL);
+
 static struct attribute *bsnapshot_dev_attrs[] = {
     &dev_attr_active.attr,
+    &dev_attr_extents.attr,
+    &dev_attr_stats.attr,
     NULL,
 };
 
@@ -5,15 +5,21 @@
 #include <linux/time64.h>
 #include <linux/types.h>
 
+/**
+ * page_iter holds len bytes read from the device starting at the byte start of the written range, they are stored in page
+ * at offset.
+ */
 struct page_iter {
     struct page       *page;
+    unsigned long      start;
     unsigned int       offset;
     unsigned int       len;
 };
 
 /**
- * bio_private_data contains the original write bio request, the sector from which the write starts,
- * the number of pages to use to contains the data and an auxiliary struct to hold the data read from the device
+ * bio_private_data contains the original write bio request, the sector from which the write starts, the number of bytes
+ * written and an auxiliary struct to hold the data read from the device. Only the sectors that the session didn't preserve
+ * yet are read, iter is sorted by start and it can have holes.
  */
 struct bio_private_data {
     struct bio        *orig_bio;
@@ -21,6 +27,9 @@ struct bio_private_data {
     sector_t           sector;
     unsigned long      bytes;
     unsigned long      iter_capacity;
+    // when the read bios have been submitted and when they have completed (ktime_get_ns)
+    u64                read_submitted_ns;
+    u64                read_completed_ns;
     int                iter_len;
     struct page_iter   iter[];
 };
@@ -28,7 +37,7 @@ struct bio_private_data {
 #define page_iter_for_each(pos, pd)\
         for ((pos) = (pd)->iter; pos < &(pd)->iter[(pd)->iter_len]; ++pos)\
 
-int write_bio_enqueue(struct bio *bio);
+int write_bio_enqueue(struct bio *bio, u64 intercepted_ns);
 
 void dbg_dump_bio(const char *prefix, struct bio *bio);
 
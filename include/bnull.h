@@ -1,11 +1,14 @@
 #ifndef BNULL_H
 #define BNULL_H
+#include <linux/blk_types.h>
 #include <linux/types.h>
 
-int bnull_init(void);
+int bnull_init(unsigned int queue_depth);
 
 void bnull_cleanup(void);
 
-struct block_device *bnull_get_bdev(void);
+struct bio *bnull_bio_alloc(bio_end_io_t *end_io, void *private);
+
+u64 bnull_bio_allocated_on(struct bio *bio);
 
 #endif
\ No newline at end of file
@@ -1,18 +1,26 @@
 #ifndef AOS_ITREE_H
 #define AOS_ITREE_H
-#include "b_range.h"
 #include "session.h"
-#include <linux/rbtree.h>
-#include <linux/slab.h>
-#include <linux/spinlock_types.h>
 #include <linux/types.h>
 
+/**
+ * itree_stats describes the fragmentation of a session tree, the average length of an extent is nr_sectors / nr_extents.
+ */
+struct itree_stats {
+    unsigned long nr_extents;
+    unsigned long nr_sectors;
+};
+
 int itree_create(struct session *s);
 
 void itree_destroy(struct session *s);
 
-int itree_add(struct session *s, struct b_range *range);
+bool itree_contains_range(struct session *s, unsigned long start, unsigned long end_excl);
+
+unsigned long itree_find_gaps(struct session *s, unsigned long start, unsigned long end_excl, unsigned long *gaps);
+
+int itree_insert_and_report_new(struct session *s, unsigned long start, unsigned long end_excl, unsigned long *added, unsigned long idx);
 
-bool itree_subset_of(struct session *s, unsigned long start, unsigned long end_excl);
+void itree_get_stats(struct session *s, struct itree_stats *stats);
 
-#endif
\ No newline at end of file
+#endif
@@ -87,6 +87,10 @@ int singlefilefs_fill_super_entry_handler(struct kretprobe_instance *kp, struct
 
 int singlefilefs_fill_super_handler(struct kretprobe_instance *kp, struct pt_regs *regs);
 
+void submit_bio_handler_init(bool use_bnull);
+
 int submit_bio_pre_handler(struct kprobe *kp, struct pt_regs *regs);
 
+void submit_bio_post_handler(struct kprobe *kp, struct pt_regs *regs, unsigned long flags);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef AOS_LATENCY_H
+#define AOS_LATENCY_H
+#include <linux/types.h>
+
+/**
+ * latency_stage names the stages of the copy-on-write pipeline whose latency is measured:
+ * - LAT_QUEUE: from the interception of a write to the start of process_bio;
+ * - LAT_READ: from the submission of the read bios to read_original_block_end_io;
+ * - LAT_RESUBMIT: from read_original_block_end_io to the submission of the original bio by snapshot_save;
+ * - LAT_SAVE_QUEUE: from the scheduling of a block_work to the start of save_block;
+ * - LAT_WRITE: from the start of snap_map_write to the completion of the write of the data file.
+ */
+enum latency_stage {
+    LAT_QUEUE,
+    LAT_READ,
+    LAT_RESUBMIT,
+    LAT_SAVE_QUEUE,
+    LAT_WRITE,
+    LAT_NR_STAGES,
+};
+
+void latency_init(void);
+
+void latency_cleanup(void);
+
+int latency_dev_add(dev_t dev);
+
+void latency_record(dev_t dev, enum latency_stage stage, u64 start_ns);
+
+#endif
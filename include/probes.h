@@ -1,8 +1,13 @@
 #ifndef PROBES_H
 #define PROBES_H
+#include <linux/types.h>
 
-int probes_init(void);
+int probes_init(bool use_bnull);
 
 void probes_cleanup(void);
 
+unsigned long probes_kprobe_nmissed(void);
+
+unsigned long probes_kretprobe_nmissed(void);
+
 #endif
\ No newline at end of file
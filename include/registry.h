@@ -1,6 +1,5 @@
 #ifndef AOS_REGISTRY_H
 #define AOS_REGISTRY_H
-#include "b_range.h"
 #include "session.h"
 #include <linux/time64.h>
 #include <linux/types.h>
@@ -31,10 +30,15 @@ void registry_session_destroy(dev_t dev);
 
 bool registry_session_id(dev_t dev, struct timespec64 *time, char *dirname, size_t n, struct timespec64 *created_on);
 
-int registry_add_range(dev_t dev, struct timespec64 *created_on, struct b_range *range);
+int registry_add_range(dev_t dev, struct timespec64 *created_on, unsigned long start, unsigned long end_excl, unsigned long *added,
+                       unsigned long idx);
 
 int registry_lookup_range(dev_t dev, unsigned long start, unsigned long end_excl);
 
+long registry_lookup_gaps(dev_t dev, unsigned long start, unsigned long end_excl, unsigned long *gaps);
+
 ssize_t registry_show_session(char *buf, size_t size);
 
+ssize_t registry_show_extents(char *buf, size_t size);
+
 #endif
\ No newline at end of file
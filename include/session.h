@@ -1,16 +1,28 @@
 #ifndef AOS_SESSION_H
 #define AOS_SESSION_H
+#include <linux/kref.h>
 #include <linux/maple_tree.h>
+#include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/time64.h>
 #include <linux/types.h>
 #define ENOSSN     5004
 
+/**
+ * session is a snapshot of a device, tree holds the sectors whose original content has been preserved. The registry
+ * holds a reference, the save path takes another one while it inserts a range into tree.
+ */
 struct session {
     struct rcu_head    rcu;
+    struct kref        ref;
     dev_t              dev;
     struct timespec64  created_on;
     struct maple_tree  tree;
+    // serializes the insertions into tree, the lookups are lockless
+    struct mutex       tree_lock;
+    // number of ranges in tree and number of sectors they cover, they are updated under tree_lock
+    unsigned long      nr_extents;
+    unsigned long      nr_sectors;
 };
 
 int get_dirname_prefix_len(void);
@@ -19,6 +31,8 @@ int get_dirname_len(void);
 
 struct session *session_create(dev_t dev);
 
-void session_destroy(struct session *s);
+bool session_get(struct session *s);
+
+void session_put(struct session *s);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef AOS_SNAP_FORMAT_H
+#define AOS_SNAP_FORMAT_H
+#include <linux/types.h>
+
+/**
+ * Layout of the data file of a session (version 2), this header is shared with the user space CLI.
+ * The file is a sequence of records, every record starts with a snap_rec_header and it's rec_len bytes long. Records start at
+ * multiples of SNAP_REC_ALIGN bytes (or of the alignment written in the superblock), so the space reserved by a writer that
+ * crashed reads as zeros and can be skipped SNAP_REC_ALIGN bytes at a time.
+ * A segment is made of a SNAP_REC_SUPER record, the SNAP_REC_EXTENT records of the sectors saved and, when the session is closed,
+ * a SNAP_REC_INDEX record whose last bytes are a snap_footer. A new segment is appended if the file is opened again.
+ * Files that don't start with a SNAP_REC_SUPER record use the format version 1, that is a sequence of
+ * {sector, nbytes} headers each one followed by nbytes bytes.
+ */
+#define SNAP_FORMAT_VERSION (2)
+#define SNAP_REC_ALIGN      (32)
+#define SNAP_REC_SUPER      (0x53504e53)
+#define SNAP_REC_EXTENT     (0x58504e53)
+#define SNAP_REC_INDEX      (0x49504e53)
+#define SNAP_FOOTER_MAGIC   (0x52544f4f46504e53ULL)
+
+/**
+ * snap_rec_header is the header of each record. crc is the crc32c (not inverted, with ~0 as seed) of the header, whose crc is zero,
+ * followed by the nbytes bytes of payload that start data_off bytes after the header.
+ */
+struct snap_rec_header {
+    __u32 magic;
+    __u32 crc;
+    // first sector of an extent, zero otherwise
+    __u64 sector;
+    __u64 rec_len;
+    __u32 nbytes;
+    __u32 data_off;
+};
+
+struct snap_superblock {
+    __u32 version;
+    // every record of the segment starts at a multiple of align bytes
+    __u32 align;
+    __u32 dev;
+    __u32 reserved;
+    __s64 created_on_sec;
+    __s64 created_on_nsec;
+};
+
+/**
+ * The payload of a SNAP_REC_INDEX record is an array of snap_index_entry sorted by sector, one for each extent of the segment.
+ */
+struct snap_index_entry {
+    __u64 sector;
+    // offset of the extent record from the start of the file
+    __u64 offset;
+    __u32 nbytes;
+    __u32 reserved;
+};
+
+/**
+ * snap_footer takes the last bytes of a SNAP_REC_INDEX record, if the file has been closed cleanly it's also the end of the file.
+ */
+struct snap_footer {
+    __u64 magic;
+    __u64 index_offset;
+    __u64 segment_offset;
+    __u64 count;
+};
+
+#endif
@@ -5,12 +5,14 @@
 #include <linux/time64.h>
 #include <linux/types.h>
 
-int snapshot_init(const char *directory);
+int snapshot_init(const char *directory, int work_pool_size, bool use_direct_io);
 
 void snapshot_cleanup(void);
 
 void snap_map_destroy(dev_t dev, struct timespec64 *created_on);
 
-int write_bio_enqueue(struct bio *bio);
+int write_bio_enqueue(struct bio *bio, u64 intercepted_ns);
+
+bool snapshot_is_resubmitting(struct bio *bio);
 
 #endif
\ No newline at end of file
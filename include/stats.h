@@ -0,0 +1,54 @@
+#ifndef AOS_STATS_H
+#define AOS_STATS_H
+#include <linux/dcache.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+/**
+ * stat_item names the counters of the copy-on-write pipeline. The *_QUEUED items are gauges: they are incremented when a work
+ * item is queued and decremented when it starts, so their sum over the CPUs is the depth of the workqueue.
+ */
+enum stat_item {
+    STAT_INTERCEPTED,
+    STAT_SKIPPED,
+    STAT_DEFERRED,
+    STAT_COW_READ_BYTES,
+    STAT_SAVED_BYTES,
+    STAT_DEDUP_BYTES,
+    STAT_ALLOC_FAILURES,
+    STAT_WRITE_BIO_QUEUED,
+    STAT_READ_BIO_QUEUED,
+    STAT_SAVE_BLOCKS_QUEUED,
+    STAT_NR_ITEMS,
+};
+
+struct snap_stats {
+    u64 items[STAT_NR_ITEMS];
+};
+
+DECLARE_PER_CPU(struct snap_stats, snap_stats);
+
+/**
+ * stats_add adds n to the counter item of the current CPU, it can be called from any context.
+ */
+static inline void stats_add(enum stat_item item, u64 n) {
+    this_cpu_add(snap_stats.items[item], n);
+}
+
+static inline void stats_inc(enum stat_item item) {
+    this_cpu_inc(snap_stats.items[item]);
+}
+
+static inline void stats_dec(enum stat_item item) {
+    this_cpu_dec(snap_stats.items[item]);
+}
+
+void stats_init(void);
+
+void stats_cleanup(void);
+
+struct dentry *stats_debugfs_dir(void);
+
+ssize_t stats_show(char *buf, size_t size);
+
+#endif
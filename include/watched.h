@@ -0,0 +1,39 @@
+#ifndef AOS_WATCHED_H
+#define AOS_WATCHED_H
+#include <linux/bitops.h>
+#include <linux/cache.h>
+#include <linux/hash.h>
+#include <linux/swab.h>
+#include <linux/types.h>
+#define WATCHED_BITS (13)
+
+/**
+ * watched_devices is a counting bloom filter of the device numbers with an active session. It is written only when a session
+ * is created or destroyed, so every CPU keeps it in its cache and the submit_bio kprobe can reject the writes to devices
+ * that are not watched without taking any lock.
+ */
+extern unsigned long watched_devices[BITS_TO_LONGS(1 << WATCHED_BITS)] __read_mostly;
+
+static inline u32 watched_hash1(dev_t dev) {
+    return hash_32(dev, WATCHED_BITS);
+}
+
+// minor numbers are stored in the low bits of dev_t, swapping the bytes spreads them across the whole key
+static inline u32 watched_hash2(dev_t dev) {
+    return hash_32(swab32(dev), WATCHED_BITS);
+}
+
+/**
+ * watched_maybe returns false if there is no active session associated to the device number dev, true if there may be one.
+ */
+static inline bool watched_maybe(dev_t dev) {
+    return test_bit(watched_hash1(dev), watched_devices) && test_bit(watched_hash2(dev), watched_devices);
+}
+
+void watched_add(dev_t dev);
+
+void watched_del(dev_t dev);
+
+void watched_reset(void);
+
+#endif
@@ -2,10 +2,12 @@
 #include "bio.h"
 #include "bnull.h"
 #include "chrdev.h"
+#include "latency.h"
 #include "pr_format.h"
 #include "probes.h"
 #include "registry.h"
 #include "snapshot.h"
+#include "stats.h"
 #include <linux/crypto.h>
 #include <linux/delay.h>
 #include <linux/init.h>
@@ -23,12 +25,30 @@ static char *snapshots_directory = "/snapshots";
 module_param(snapshots_directory, charp, 0444);
 MODULE_PARM_DESC(snapshots_directory, "Directory where snapshots will be stored");
 
+static int work_pool_size = 256;
+module_param(work_pool_size, int, 0444);
+MODULE_PARM_DESC(work_pool_size, "Number of work items reserved for each stage of the copy-on-write pipeline");
+
+static bool direct_io;
+module_param(direct_io, bool, 0444);
+MODULE_PARM_DESC(direct_io, "Write the snapshots with direct I/O, bypassing the page cache");
+
+static bool use_bnull = true;
+module_param(use_bnull, bool, 0444);
+MODULE_PARM_DESC(use_bnull, "Defer the intercepted writes with a dummy bio sent to the bnull device (default), set it to 0 to make submit_bio return without submitting them");
+
+static unsigned int bnull_queue_depth = 128;
+module_param(bnull_queue_depth, uint, 0444);
+MODULE_PARM_DESC(bnull_queue_depth, "Number of tags of each hardware queue (one per CPU) of the bnull device");
+
 static int __init bsnapshot_init(void) {
     int err = auth_set_password(password);
     if (err) {
         return err;
     }
-    err = snapshot_init(snapshots_directory);
+    stats_init();
+    latency_init();
+    err = snapshot_init(snapshots_directory, work_pool_size, direct_io);
     if (err) {
         goto snapshot_init_failed;
     }
@@ -40,36 +60,47 @@ static int __init bsnapshot_init(void) {
     if (err) {
         goto chrdev_failed;
     }
-    err = probes_init();
-    if (err) {
-        goto probes_init_failed;
+    if (use_bnull) {
+        err = bnull_init(bnull_queue_depth);
+        if (err) {
+            goto bnull_init_failed;
+        }
     }
-    err = bnull_init();
+    err = probes_init(use_bnull);
     if (err) {
-        goto bnull_init_failed;
+        goto probes_init_failed;
     }
     return err;
 
-bnull_init_failed:
-    probes_cleanup();
 probes_init_failed:
+    if (use_bnull) {
+        bnull_cleanup();
+    }
+bnull_init_failed:
     chrdev_cleanup();
 chrdev_failed:
     registry_cleanup();
 registry_failed:
     snapshot_cleanup();
 snapshot_init_failed:
+    stats_cleanup();
+    latency_cleanup();
     auth_clear_password();
     pr_err("bsnapshots_init failed, got error %d", err);
     return err;
 }
 
 static void __exit bsnapshot_exit(void) {
-    bnull_cleanup();
+    // the probes are unregistered first, so no write is deferred with a dummy bio of a device that no longer exists
     probes_cleanup();
+    if (use_bnull) {
+        bnull_cleanup();
+    }
     chrdev_cleanup();
     registry_cleanup();
     snapshot_cleanup();
+    stats_cleanup();
+    latency_cleanup();
     auth_clear_password();
 }
 
@@ -6,6 +6,7 @@
 #include <linux/fs_context.h>
 #include <linux/kprobes.h>
 #include <linux/list.h>
+#include <linux/rcupdate.h>
 #include <linux/types.h>
 
 static struct kretprobe ext4_fill_super_kretprobe = {
@@ -25,6 +26,7 @@ static struct kretprobe kill_block_super_kretprobe = {
 static struct kprobe submit_bio_kprobe = {
     .symbol_name = "submit_bio",
     .pre_handler = submit_bio_pre_handler,
+    .post_handler = submit_bio_post_handler,
 };
 
 static struct kretprobe singlefilefs_fill_super_kretprobe = {
@@ -41,10 +43,31 @@ static struct kretprobe *kretprobe_table[] = {
 };
 static const size_t KRETPROBES_NUM = sizeof(kretprobe_table) / sizeof(struct kretprobe*);
 
-int probes_init(void) {
+// true if the writes intercepted by submit_bio_kprobe are deferred through bnull
+static bool bnull_deferral;
+
+/**
+ * submit_bio_kprobe_unregister unregisters submit_bio_kprobe. Without bnull, a deferred write makes submit_bio return through
+ * submit_bio_just_return, which lives in the text of this module: a task preempted before it executes the ret would run freed
+ * memory once the module is removed. unregister_kprobe waits only for a normal RCU grace period, that doesn't cover such a
+ * task, so this also waits until every task has gone through a voluntary context switch and none of them can be in the stub.
+ */
+static void submit_bio_kprobe_unregister(void) {
+    unregister_kprobe(&submit_bio_kprobe);
+    if (!bnull_deferral) {
+        synchronize_rcu_tasks();
+    }
+}
+
+/**
+ * probes_init registers the probes, the writes intercepted by submit_bio are deferred through bnull if use_bnull is true.
+ */
+int probes_init(bool use_bnull) {
     if (KRETPROBES_NUM <= 0) {
         return 0;
     }
+    bnull_deferral = use_bnull;
+    submit_bio_handler_init(use_bnull);
     int err = register_kprobe(&submit_bio_kprobe);
     if (err) {
         pr_err("cannot register kprobe for submit_bio, got error %d", err);
@@ -53,16 +76,35 @@ int probes_init(void) {
     err = register_kretprobes(kretprobe_table, KRETPROBES_NUM);
     if (err) {
         pr_err("cannot register kretprobes, got error %d", err);
-        unregister_kprobe(&submit_bio_kprobe);
+        submit_bio_kprobe_unregister();
     }
     return err;
 }
 
 void probes_cleanup(void) {
-    unregister_kprobe(&submit_bio_kprobe);
+    submit_bio_kprobe_unregister();
     for (int i = 0; i < KRETPROBES_NUM; ++i) {
         struct kretprobe *kp = kretprobe_table[i];
         pr_debug(pr_format("%s: #missed=%d"), kp->kp.symbol_name, kp->nmissed);
     }
     unregister_kretprobes(kretprobe_table, KRETPROBES_NUM);
-}
\ No newline at end of file
+}
+
+/**
+ * probes_kprobe_nmissed returns the number of times the submit_bio kprobe has been skipped because another probe was running.
+ */
+unsigned long probes_kprobe_nmissed(void) {
+    return READ_ONCE(submit_bio_kprobe.nmissed);
+}
+
+/**
+ * probes_kretprobe_nmissed returns the number of hits missed by the kretprobes, either because another probe was running or because
+ * no instance was available to record the return.
+ */
+unsigned long probes_kretprobe_nmissed(void) {
+    unsigned long n = 0;
+    for (int i = 0; i < KRETPROBES_NUM; ++i) {
+        n += READ_ONCE(kretprobe_table[i]->kp.nmissed) + READ_ONCE(kretprobe_table[i]->nmissed);
+    }
+    return n;
+}
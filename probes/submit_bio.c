@@ -3,11 +3,36 @@
 #include "kretprobe_handlers.h"
 #include "pr_format.h"
 #include "registry.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "watched.h"
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/bvec.h>
+#include <linux/objtool.h>
 #include <linux/time64.h>
+#include <linux/timekeeping.h>
 #include <linux/types.h>
+#include <asm/linkage.h>
+
+// if it is true, the intercepted writes are deferred by a dummy bio sent to the bnull device
+static bool use_bnull;
+
+/**
+ * submit_bio_just_return is the instruction that submit_bio executes when a write is deferred without bnull: it returns to the
+ * caller of submit_bio, like the function that the error injection framework uses to override the return of a function.
+ */
+asm(
+    ".text\n"
+    ".type submit_bio_just_return, @function\n"
+    ".p2align 4\n"
+    "submit_bio_just_return:\n"
+    ANNOTATE_NOENDBR
+    ASM_RET
+    ".size submit_bio_just_return, .-submit_bio_just_return\n"
+);
+
+void submit_bio_just_return(void);
 
 static inline void set_arg1(struct pt_regs *regs, struct bio *arg1) {
 #ifdef CONFIG_X86_64
@@ -17,26 +42,35 @@ static inline void set_arg1(struct pt_regs *regs, struct bio *arg1) {
 #endif
 } 
 
+/**
+ * skip_function makes the probed function return as soon as the kprobe handler completes, the handler must return 1 so that
+ * the instruction probed isn't executed. The new instruction pointer is honored in both the ways a kprobe can be placed on
+ * submit_bio: a kprobe with a post_handler on the ftrace entry of the function is armed with the ftrace ops registered with
+ * FTRACE_OPS_FL_IPMODIFY, which resume at regs->ip, while an int3 kprobe whose pre_handler returns 1 skips the single-step of
+ * the probed instruction and resumes at regs->ip as well. An int3 kprobe optimized into a jump would ignore regs->ip instead,
+ * and kprobes never optimizes a probe with a post_handler. That's why submit_bio_kprobe has an empty post_handler.
+ */
+static inline void skip_function(struct pt_regs *regs) {
+#ifdef CONFIG_X86_64
+    instruction_pointer_set(regs, (unsigned long)submit_bio_just_return);
+#else
+#error "unsupported architecture"
+#endif
+}
+
 static void dummy_end_io(struct bio *bio) {
     struct bio *orig_bio = bio->bi_private;
-    write_bio_enqueue(orig_bio);
+    write_bio_enqueue(orig_bio, bnull_bio_allocated_on(bio));
     bio_put(bio);
 }
 
 static struct bio *create_dummy_bio(struct bio *orig_bio) {
-    struct block_device *bdev = bnull_get_bdev();
-    // if this pointer is NULL then the module shouldn't have been mounted
-    if (!bdev) {
-        return NULL;
-    }
-
-    struct bio *dummy = bio_alloc(bdev, 0, REQ_OP_DISCARD, GFP_ATOMIC);
+    struct bio *dummy = bnull_bio_alloc(dummy_end_io, orig_bio);
     if (!dummy) {
-        pr_err("out of memory");
+        stats_inc(STAT_ALLOC_FAILURES);
+        pr_err("cannot allocate dummy bio");
         return NULL;
     }
-    dummy->bi_end_io = dummy_end_io;
-    dummy->bi_private = orig_bio;
     return dummy;
 }
 
@@ -44,15 +78,6 @@ static inline unsigned long bio_size(struct bio *bio) {
     return bio->bi_iter.bi_size;
 }
 
-static inline bool bio_is_marked(struct bio *bio) {
-    if (bio_flagged(bio, 15)) {
-        bio_clear_flag(bio, 15);
-        return true;
-    }
-    bio_set_flag(bio, 15);
-    return false;
-}
-
 static inline bool empty_write(struct bio *bio) {
     // empty writes are possible because can be sent as write barriers
     return op_is_write(bio->bi_opf)
@@ -62,33 +87,84 @@ static inline bool empty_write(struct bio *bio) {
 /**
  * skip_handler returns true if the submit_bio entry handler shouldn't execute, that is a bio:
  * 1. is null or is not a write bio;
- * 2. has been already intercepted by the kretprobe. A bio request could be intercepted twice if it is attempting to write a block that has been never
- *    written before;
- * 3. is attempting to write to a block whose snapshot has been already saved in /snapshots.
+ * 2. targets a device without an active session. Most of the writes fall in this case so they are filtered by watched_maybe
+ *    before anything else;
+ * 3. has been already intercepted by the kprobe and it is being submitted by the module (see snapshot_is_resubmitting). A bio request could
+ *    be intercepted twice if it is attempting to write a block that has been never written before;
+ * 4. is attempting to write to a block whose snapshot has been already saved in /snapshots.
  *    skip_handler always returns true in case of errors, if the iset_* API(s) are misbeheaving, then executing the submit_bio handler could lead to catastrophic
  *    results.
  */
 static bool skip_handler(struct bio *bio) {
-    if (!bio
-        || !op_is_write(bio->bi_opf)
-        || empty_write(bio)
-        || bio_is_marked(bio)) {
+    if (!bio || !op_is_write(bio->bi_opf)) {
         return true;
     }
     if (!bio->bi_bdev) {
         pr_err("cannot read device number from bio struct");
         return true;
     }
+    if (!watched_maybe(bio->bi_bdev->bd_dev)
+        || empty_write(bio)
+        || snapshot_is_resubmitting(bio)) {
+        return true;
+    }
+    stats_inc(STAT_INTERCEPTED);
     int err = registry_lookup_range(bio->bi_bdev->bd_dev, bio->bi_iter.bi_sector, bio->bi_iter.bi_sector + DIV_ROUND_UP(bio_size(bio), 512));
     if (err) {
         if (err != -ENOSSN && err != -EEXIST) {
             pr_err("registry_lookup_range: completed with error %d", err);
         }
+        stats_inc(STAT_SKIPPED);
         return true;
     }
     return false;
 }
 
+/**
+ * submit_bio_handler_init selects how the intercepted writes are deferred, it must be called before the kprobe is registered.
+ */
+void submit_bio_handler_init(bool bnull) {
+    use_bnull = bnull;
+}
+
+/**
+ * defer_with_bnull replaces the bio pointer in the stack area (the area where struct pt_regs points to) with another bio request
+ * that is directed to the bnull block device (see the 'bnull' directory for more details). The request is called dummy because
+ * it does pratically nothing: it is an empty discard request completed by the device right away, its callback schedules the
+ * original bio. It costs an allocation and a tag of bnull for each write.
+ */
+static int defer_with_bnull(struct bio *bio, struct pt_regs *regs) {
+    struct bio *dummy_bio = create_dummy_bio(bio);
+    if (dummy_bio) {
+        set_arg1(regs, dummy_bio);
+        stats_inc(STAT_DEFERRED);
+    } else {
+        pr_err("cannot create dummy bio");
+    }
+    return 0;
+}
+
+/**
+ * defer_direct schedules the original bio and makes submit_bio return right away, so the deferral doesn't allocate anything
+ * but the work item and the number of writes in flight isn't bounded by the tags of bnull. If the work item cannot be allocated
+ * submit_bio proceeds and the write isn't preserved.
+ */
+static int defer_direct(struct bio *bio, struct pt_regs *regs) {
+    if (write_bio_enqueue(bio, ktime_get_ns())) {
+        pr_err("cannot defer write bio of sector %llu", bio->bi_iter.bi_sector);
+        return 0;
+    }
+    stats_inc(STAT_DEFERRED);
+    skip_function(regs);
+    return 1;
+}
+
+/**
+ * submit_bio_post_handler does nothing, it only prevents kprobes from optimizing submit_bio_kprobe (see skip_function).
+ */
+void submit_bio_post_handler(struct kprobe *kp, struct pt_regs *regs, unsigned long flags) {
+}
+
 /**
  * This entry handler do the following steps:
  * 1. Checks if the bio should be intercepted. A bio request should be intercepted if it's
@@ -96,13 +172,13 @@ static bool skip_handler(struct bio *bio) {
  *    been already intercepted and it is directed to a region of the device not already hit by another
  *    write request.
  * 2. If a bio request should be intercepted, we cannot submit it to the bio layer because we need to copy the original
- *    content of the region hit by the request before applying the write. We replace the bio pointer in the stack area
- *    (the area where struct pt_regs points to) with another bio request that is directed to the bnull block device
- *    (see the 'bnull' directory for more details). The request is called dummy because it does pratically nothing: it is
- *    an empty read requests that is discarded by the device anyway.
- * 3. The original bio request is submitted to workqueue by bio_enqueue for further processing.
- * 4. The write request should be eventually submitted to the bio layer so this kretprobe will intercept the bio request twice,
- *    and even the second time the latter is eligible to be intercepted so we need to keep track of the requests already intercepted.
+ *    content of the region hit by the request before applying the write. The original bio request is submitted to workqueue
+ *    by write_bio_enqueue for further processing, and submit_bio returns without submitting it (see defer_direct). If the
+ *    module has been loaded with use_bnull, the bio is replaced by a dummy bio whose completion enqueues the original one
+ *    (see defer_with_bnull).
+ * 3. The write request should be eventually submitted to the bio layer so this kprobe will intercept the bio request twice,
+ *    and even the second time the latter is eligible to be intercepted. The module submits it from the work item that owns it,
+ *    which records the bio being submitted, so no field of the bio is used to recognize it.
  */
 int submit_bio_pre_handler(struct kprobe *kp, struct pt_regs *regs) {
     struct bio *bio = get_arg1(struct bio*, regs);
@@ -113,11 +189,8 @@ int submit_bio_pre_handler(struct kprobe *kp, struct pt_regs *regs) {
     if (skip_handler(bio)) {
         return 0;
     }
-    struct bio *dummy_bio = create_dummy_bio(bio);
-    if (dummy_bio) {
-        set_arg1(regs, dummy_bio);
-    } else {
-        pr_err("cannot create dummy bio");
+    if (use_bnull) {
+        return defer_with_bnull(bio, regs);
     }
-    return 0;
-}
\ No newline at end of file
+    return defer_direct(bio, regs);
+}
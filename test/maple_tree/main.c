@@ -1,73 +1,145 @@
+#include "itree.h"
+#include "session.h"
+#include <linux/bitmap.h>
 #include <linux/maple_tree.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/prandom.h>
 #include <linux/printk.h>
+#include <linux/slab.h>
 
-struct b_range {
-    int lo, hi;
-};
+// number of sectors of the device
+static unsigned long     nr_sectors = 1 << 20;
+module_param(nr_sectors, ulong, 0444);
+// number of ranges inserted into the tree
+static unsigned long     n = 200000;
+module_param(n, ulong, 0444);
+// maximum length of a range in sectors
+static unsigned int      max_len = 64;
+module_param(max_len, uint, 0444);
+static struct rnd_state  rnd;
+static uint64_t          seed = 3141592653589793238ULL;
 
-static struct b_range data[] = {
-    {.lo=16, .hi=24},
-};
-static int n = sizeof(data) / sizeof(struct b_range);
+static unsigned long random_below(unsigned long bound) {
+    return prandom_u32_state(&rnd) % bound;
+}
 
-static int insert_all(struct maple_tree *t) {
-    for (int i = 0; i < n; ++i) {
-        struct b_range *r = &data[i];
-        int err = mtree_store_range(t, r->lo, r->hi, r, GFP_KERNEL);
-        if (err) {
-            pr_err("cannot insert range [%d, %d), got error %d", r->lo, r->hi, err);
-            return err;
+/**
+ * check_insert inserts [start, end_excl) into the tree of s and checks that the sectors it reports as new are the ones
+ * that aren't set in ref, then it sets them in ref.
+ */
+static int check_insert(struct session *s, unsigned long *ref, unsigned long *added, unsigned long start, unsigned long end_excl) {
+    unsigned long len = end_excl - start;
+    bitmap_zero(added, max_len);
+    int err = itree_insert_and_report_new(s, start, end_excl, added, 0);
+    if (err) {
+        pr_err("cannot insert range [%lu, %lu), got error %d", start, end_excl, err);
+        return err;
+    }
+    for (unsigned long i = 0; i < len; ++i) {
+        if (test_bit(i, added) == test_bit(start + i, ref)) {
+            pr_err("range [%lu, %lu): sector %lu reported as %s", start, end_excl, start + i,
+                   test_bit(i, added) ? "new" : "covered");
+            return -EINVAL;
         }
     }
+    bitmap_set(ref, start, len);
     return 0;
 }
 
-static void update_span(struct b_range *q, struct b_range *r, unsigned long *span) {
-    if (q->lo >= r->lo && q->hi <= r->hi) {
-        q->lo = q->hi;
-    } else if (q->lo >= r->lo) {
-        q->lo = r->hi;
-    } else if (q->hi <= r->hi) {
-        q->hi = r->lo;
+/**
+ * check_query checks that itree_contains_range and itree_find_gaps agree with ref for the range [start, end_excl).
+ */
+static int check_query(struct session *s, unsigned long *ref, unsigned long *gaps, unsigned long start, unsigned long end_excl) {
+    bool expected = find_next_zero_bit(ref, end_excl, start) >= end_excl;
+    if (itree_contains_range(s, start, end_excl) != expected) {
+        pr_err("query [%lu, %lu): expected %s", start, end_excl, expected ? "covered" : "not covered");
+        return -EINVAL;
     }
-    *span = q->hi - q->lo;
-    pr_info("update_span: span=%lu", *span);
-}
-
-static bool mt_covers(struct maple_tree *tree, struct b_range *q) {
-    unsigned long span = 1;
-    struct b_range tmp;
-    memcpy(&tmp, q, sizeof(struct b_range));
-    struct b_range *r;
-    unsigned long index = q->lo;
-    mt_for_each(tree, r, index, q->hi) {
-        update_span(&tmp, r, &span);
+    bitmap_zero(gaps, max_len);
+    unsigned long n = itree_find_gaps(s, start, end_excl, gaps);
+    unsigned long missing = 0;
+    for (unsigned long i = 0; i < end_excl - start; ++i) {
+        if (test_bit(i, gaps) == test_bit(start + i, ref)) {
+            pr_err("query [%lu, %lu): sector %lu reported as %s", start, end_excl, start + i,
+                   test_bit(i, gaps) ? "not covered" : "covered");
+            return -EINVAL;
+        }
+        missing += !test_bit(start + i, ref);
     }
-    return !span;
+    if (n != missing) {
+        pr_err("query [%lu, %lu): %lu sectors not covered, expected %lu", start, end_excl, n, missing);
+        return -EINVAL;
+    }
+    return 0;
 }
 
-static void mt_test(struct maple_tree *tree, int test_no, struct b_range *query) {
-    char *result = mt_covers(tree, query) ? "yes" : "no";
-    pr_info("test %d: is query=[%d, %d) fully covered? %s", test_no, query->lo, query->hi, result);
+/**
+ * check_extents checks that the tree holds exactly one range for every run of ones of ref and that the stats agree.
+ */
+static int check_extents(struct session *s, unsigned long *ref) {
+    unsigned long runs = 0;
+    unsigned long first, last_excl;
+    for_each_set_bitrange(first, last_excl, ref, nr_sectors) {
+        ++runs;
+    }
+    unsigned long entries = 0;
+    unsigned long index = 0;
+    void *entry;
+    mt_for_each(&s->tree, entry, index, ULONG_MAX) {
+        ++entries;
+    }
+    struct itree_stats stats;
+    itree_get_stats(s, &stats);
+    unsigned long weight = bitmap_weight(ref, nr_sectors);
+    pr_info("%lu sectors in %lu extents (%lu sectors per extent), reference has %lu sectors in %lu runs",
+            stats.nr_sectors, stats.nr_extents, stats.nr_extents ? stats.nr_sectors / stats.nr_extents : 0, weight, runs);
+    if (entries != runs || stats.nr_extents != runs || stats.nr_sectors != weight) {
+        pr_err("tree has %lu ranges, expected %lu", entries, runs);
+        return -EINVAL;
+    }
+    return 0;
 }
 
 static int __init mtree_test_init(void) {
-    struct maple_tree tree;
-    mt_init_flags(&tree, MT_FLAGS_ALLOC_RANGE | MT_FLAGS_USE_RCU);
-    int err = insert_all(&tree);
-    if (err) goto out;
-
-    struct b_range queries[] = {
-        {.lo=8, .hi=16},
-    };
-    for (int i = 0; i < sizeof(queries)/sizeof(struct b_range); ++i) {
-        mt_test(&tree, i+1, &queries[i]);
+    if (!max_len || max_len > nr_sectors) {
+        max_len = min_t(unsigned long, 64, nr_sectors);
+    }
+    prandom_seed_state(&rnd, seed);
+    int err = -ENOMEM;
+    unsigned long *ref = bitmap_zalloc(nr_sectors, GFP_KERNEL);
+    unsigned long *added = bitmap_zalloc(max_len, GFP_KERNEL);
+    unsigned long *gaps = bitmap_zalloc(max_len, GFP_KERNEL);
+    struct session *s = session_create(MKDEV(0, 0));
+    if (!ref || !added || !gaps || !s) {
+        pr_err("out of memory");
+        goto out;
+    }
+    for (unsigned long i = 0; i < n; ++i) {
+        unsigned long len = 1 + random_below(max_len);
+        unsigned long start = random_below(nr_sectors - len + 1);
+        err = check_insert(s, ref, added, start, start + len);
+        if (err) {
+            goto out;
+        }
+        len = 1 + random_below(max_len);
+        start = random_below(nr_sectors - len + 1);
+        err = check_query(s, ref, gaps, start, start + len);
+        if (err) {
+            goto out;
+        }
+    }
+    err = check_extents(s, ref);
+    if (!err) {
+        pr_info("%lu insertions and queries agree with the reference bitmap", n);
     }
-
 out:
-    mtree_destroy(&tree);
+    if (s) {
+        session_put(s);
+    }
+    bitmap_free(gaps);
+    bitmap_free(added);
+    bitmap_free(ref);
     return err;
 }
 
@@ -79,4 +151,4 @@ MODULE_DESCRIPTION("Maple Tree API Test");
 MODULE_LICENSE("GPL");
 
 module_init(mtree_test_init);
-module_exit(mtree_test_exit);
\ No newline at end of file
+module_exit(mtree_test_exit);
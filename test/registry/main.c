@@ -0,0 +1,87 @@
+#include "registry.h"
+#include <linux/kdev_t.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/printk.h>
+#include <linux/sched.h>
+#include <linux/sprintf.h>
+#define BENCH_MAJOR   (240)
+#define UNKNOWN_MAJOR (241)
+
+static unsigned long iterations = 1000000;
+module_param(iterations, ulong, 0444);
+MODULE_PARM_DESC(iterations, "Number of lookups measured for each registry size");
+
+static int sizes[] = {1, 64, 1024};
+static const size_t SIZES_NUM = sizeof(sizes) / sizeof(int);
+
+// registry_rcu.o destroys the bitmaps of a session when it is released, the benchmark doesn't create any
+void snap_map_destroy(dev_t dev, struct timespec64 *created_on) {
+}
+
+static int fill_registry(int n) {
+    char name[32];
+    for (int i = 0; i < n; ++i) {
+        snprintf(name, sizeof(name), "/dev/bench%d", i);
+        int err = registry_insert(name);
+        if (err) {
+            pr_err("cannot register device %s, got error %d", name, err);
+            return err;
+        }
+        err = registry_session_prealloc(name, MKDEV(BENCH_MAJOR, i));
+        if (err) {
+            pr_err("cannot create session for device %s, got error %d", name, err);
+            return err;
+        }
+    }
+    return 0;
+}
+
+/**
+ * measure returns the average latency (in nanoseconds) of registry_lookup_range, major selects whether
+ * the lookups hit registered devices (BENCH_MAJOR) or not (UNKNOWN_MAJOR).
+ */
+static u64 measure(int n, unsigned int major) {
+    u64 start = ktime_get_ns();
+    for (unsigned long i = 0; i < iterations; ++i) {
+        registry_lookup_range(MKDEV(major, i % n), 0, 8);
+        if (!(i & 0xffff)) {
+            cond_resched();
+        }
+    }
+    return (ktime_get_ns() - start) / iterations;
+}
+
+static int __init registry_bench_init(void) {
+    if (!iterations) {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < SIZES_NUM; ++i) {
+        int err = registry_init();
+        if (err) {
+            return err;
+        }
+        err = fill_registry(sizes[i]);
+        if (!err) {
+            u64 hit = measure(sizes[i], BENCH_MAJOR);
+            u64 miss = measure(sizes[i], UNKNOWN_MAJOR);
+            pr_info("devices=%d hit=%llu ns/lookup miss=%llu ns/lookup", sizes[i], hit, miss);
+        }
+        registry_cleanup();
+        if (err) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+static void __exit registry_bench_exit(void) {
+}
+
+MODULE_AUTHOR("Francesco Donnini <donnini.francesco00@gmail.com>");
+MODULE_DESCRIPTION("Registry lookup benchmark");
+MODULE_LICENSE("GPL");
+
+module_init(registry_bench_init);
+module_exit(registry_bench_exit);
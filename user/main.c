@@ -33,13 +33,18 @@ struct ioctl_params {
 static struct argp_option options[] = {
     {"path",     'p', "PATH",     0, "Path to device (required for activate/deactivate)" },
     {"password", 'w', "PASSWORD", 0, "Password (required for activate/deactivate)" },
+    {"threads",  't', "THREADS",  0, "Number of threads used by restore (default: number of CPUs)" },
+    {"direct",   'd', 0,          0, "Restore with O_DIRECT, bypassing the page cache" },
+    {"uring",    'u', 0,          0, "Restore with io_uring, falls back to threads if it isn't available" },
+    {"queue-depth", 'q', "DEPTH", 0, "Number of extents in flight with --uring (default: 32)" },
     { 0 }
 };
 
 struct argp_fields {
-    unsigned long  command;
-    char          *s1;
-    char          *s2;
+    unsigned long        command;
+    char                *s1;
+    char                *s2;
+    struct restore_opts  restore;
 };
 
 static error_t parse_opt(int opt, char *arg, struct argp_state *state) {
@@ -51,6 +56,24 @@ static error_t parse_opt(int opt, char *arg, struct argp_state *state) {
         case 'w':
             fields->s2 = arg;
             break;
+        case 't':
+            fields->restore.threads = atoi(arg);
+            if (fields->restore.threads <= 0) {
+                argp_error(state, "--threads expects a positive number but got %s", arg);
+            }
+            break;
+        case 'd':
+            fields->restore.direct = true;
+            break;
+        case 'u':
+            fields->restore.uring = true;
+            break;
+        case 'q':
+            if (atoi(arg) <= 0) {
+                argp_error(state, "--queue-depth expects a positive number but got %s", arg);
+            }
+            fields->restore.queue_depth = atoi(arg);
+            break;
         case ARGP_KEY_ARG:
             if (state->arg_num == 0) {
                 if (!strcmp(arg, "activate")) {
@@ -113,6 +136,8 @@ static void ls(void) {
 int main(int argc, char *argv[]) {
     struct argp_fields args;
     memset(&args, 0, sizeof(args));
+    args.restore.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    args.restore.queue_depth = 32;
     error_t err = argp_parse(&argp, argc, argv, 0, 0, &args);
     if (err) {
         exit(err);
@@ -149,7 +174,7 @@ int main(int argc, char *argv[]) {
             ls();
             break;
         case RESTORE_SNP:
-            err = restore_snapshot(args.s1, args.s2);
+            err = restore_snapshot(args.s1, args.s2, &args.restore);
             break;
         default:
             break;
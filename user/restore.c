@@ -1,88 +1,347 @@
+#define _GNU_SOURCE
 #include "restore.h"
+#include "restore_uring.h"
+#include "snapfile.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fts.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
-struct snap_header {
-    unsigned long sector;
-    unsigned long nbytes;
+// maximum number of bytes written by a single call to pwritev
+#define RESTORE_BATCH_MAX (4UL << 20)
+// a job is split once it holds this many bytes, so the threads get a fair share of a long run of sectors
+#define RESTORE_JOB_MAX   (32UL << 20)
+// alignment of the bounce buffer used with O_DIRECT
+#define RESTORE_DIO_ALIGN (4096)
+
+/**
+ * job is a run of extents [first, last), sorted by sector but for the overlapping ones, restored by a single thread: the extents
+ * of different jobs never overlap, so the jobs can be written concurrently.
+ */
+struct job {
+    size_t first;
+    size_t last;
 };
 
-static char *alloc_buffer(char *buf, size_t size, size_t *old_size) {
-    if (!buf) {
-        buf = malloc(size);
-    } else if (*old_size < size) {
-        buf = realloc(buf, size);
-        if (buf) {
-            *old_size = size;
-        }
-    }
-    return buf;
+struct restore_ctx {
+    struct snapfile    *sf;
+    const char         *dev;
+    int                 fd;
+    bool                direct;
+    struct job         *jobs;
+    size_t              nr_jobs;
+    atomic_size_t       next_job;
+    atomic_size_t       bytes;
+    atomic_size_t       extents;
+    atomic_size_t       torn;
+    atomic_int          err;
+};
+
+/**
+ * batch collects the extents of a job that are contiguous on the device, they are written by a single pwritev. With O_DIRECT
+ * they are copied to bounce before being written.
+ */
+struct batch {
+    struct iovec iov[IOV_MAX];
+    int          iovcnt;
+    off_t        offset;
+    size_t       len;
+    size_t       extents;
+    char        *bounce;
+};
+
+static int extent_file_cmp(const void *a, const void *b) {
+    const struct extent *x = a;
+    const struct extent *y = b;
+    return (x->hdr > y->hdr) - (x->hdr < y->hdr);
 }
 
-int restore_snapshot(const char *dev, const char *snapshot) {
-    FILE* off = fopen(dev, "rb+");
-    if (!off) {
-        perror(dev);
-        return -errno;
+/**
+ * sort_in_file_order sorts the extents [first, last) by their position in the data file, so the copy of a sector written last to
+ * the file is also the last one written to the device, like a sequential restore of the file does.
+ */
+static void sort_in_file_order(struct snapfile *sf, size_t first, size_t last) {
+    if (last - first > 1) {
+        qsort(&sf->extents[first], last - first, sizeof(*sf->extents), extent_file_cmp);
     }
+}
 
-    FILE* iff = fopen(snapshot, "rb");
-    if (!iff) {
-        perror(snapshot);
-        fclose(off);
-        return -errno;
+/**
+ * make_jobs splits the extents sorted by sector in jobs. The extents that overlap each other form a group that is written by a
+ * single thread in file order.
+ */
+static int make_jobs(struct restore_ctx *ctx) {
+    struct snapfile *sf = ctx->sf;
+    ctx->jobs = malloc((sf->nr_extents ? sf->nr_extents : 1) * sizeof(*ctx->jobs));
+    if (!ctx->jobs) {
+        return -ENOMEM;
+    }
+    size_t nr_jobs = 0;
+    uint64_t end = 0;
+    size_t len = 0;
+    size_t group = 0;
+    for (size_t i = 0; i < sf->nr_extents; ++i) {
+        struct extent *e = &sf->extents[i];
+        uint64_t start = e->sector * 512;
+        // an extent that overlaps the previous ones must be written after them by the same thread
+        bool overlaps = nr_jobs && start < end;
+        if (!overlaps) {
+            sort_in_file_order(sf, group, i);
+            group = i;
+        }
+        if (!overlaps && (!nr_jobs || start > end || len >= RESTORE_JOB_MAX)) {
+            ctx->jobs[nr_jobs++] = (struct job){ .first = i, .last = i };
+            len = 0;
+        }
+        ctx->jobs[nr_jobs - 1].last = i + 1;
+        len += e->nbytes;
+        if (start + e->nbytes > end) {
+            end = start + e->nbytes;
+        }
     }
+    sort_in_file_order(sf, group, sf->nr_extents);
+    ctx->nr_jobs = nr_jobs;
+    return 0;
+}
 
-    int err = 0;
-    char *buffer = NULL;
-    size_t last_buffer_size = 0;
-    for (;;) {
-        struct snap_header header;
-        if (fread(&header, sizeof(header), 1, iff) < 1) {
-            if (ferror(iff)) {
-                err = -errno;
-                perror(snapshot);
+static int pwritev_all(struct restore_ctx *ctx, struct iovec *iov, int iovcnt, off_t offset) {
+    while (iovcnt) {
+        ssize_t n = pwritev(ctx->fd, iov, iovcnt, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            break;
+            int err = -errno;
+            fprintf(stderr, "%s: cannot write at offset %lld: %s\n", ctx->dev, (long long)offset, strerror(errno));
+            return err;
+        }
+        offset += n;
+        while (iovcnt && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
         }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
 
-        buffer = alloc_buffer(buffer, header.nbytes, &last_buffer_size);
-        if (!buffer) {
-            err = -ENOMEM;
-            break;
+/**
+ * pwrite_direct copies the extents of b to the bounce buffer, RESTORE_BATCH_MAX bytes at a time, and writes them.
+ */
+static int pwrite_direct(struct restore_ctx *ctx, struct batch *b) {
+    off_t offset = b->offset;
+    size_t filled = 0;
+    for (int i = 0; i < b->iovcnt; ++i) {
+        const char *src = b->iov[i].iov_base;
+        size_t left = b->iov[i].iov_len;
+        while (left) {
+            size_t n = left < RESTORE_BATCH_MAX - filled ? left : RESTORE_BATCH_MAX - filled;
+            memcpy(b->bounce + filled, src, n);
+            filled += n;
+            src += n;
+            left -= n;
+            if (filled == RESTORE_BATCH_MAX || (!left && i == b->iovcnt - 1)) {
+                struct iovec iov = { .iov_base = b->bounce, .iov_len = filled };
+                int err = pwritev_all(ctx, &iov, 1, offset);
+                if (err) {
+                    return err;
+                }
+                offset += filled;
+                filled = 0;
+            }
         }
+    }
+    return 0;
+}
 
-        size_t n = fread(buffer, 1, header.nbytes, iff);
-        if (n < header.nbytes) {
-            if (ferror(iff)) {
-                err = -errno;
-                perror(snapshot);
-            } else {
-                err = EOF;
-                fprintf(stderr, "EOF met too early");
+static int flush(struct restore_ctx *ctx, struct batch *b) {
+    if (!b->iovcnt) {
+        return 0;
+    }
+    int err = ctx->direct ? pwrite_direct(ctx, b) : pwritev_all(ctx, b->iov, b->iovcnt, b->offset);
+    if (!err) {
+        atomic_fetch_add(&ctx->bytes, b->len);
+        atomic_fetch_add(&ctx->extents, b->extents);
+    }
+    b->iovcnt = 0;
+    b->len = 0;
+    b->extents = 0;
+    return err;
+}
+
+static int restore_job(struct restore_ctx *ctx, struct job *job, struct batch *b) {
+    for (size_t i = job->first; i < job->last; ++i) {
+        struct extent *e = &ctx->sf->extents[i];
+        if (!extent_valid(e)) {
+            fprintf(stderr, "ignoring torn extent of sector %llu\n", (unsigned long long)e->sector);
+            atomic_fetch_add(&ctx->torn, 1);
+            continue;
+        }
+        off_t offset = e->sector * 512;
+        bool contiguous = b->iovcnt && offset == b->offset + (off_t)b->len;
+        if (!contiguous || b->iovcnt == IOV_MAX || b->len + e->nbytes > RESTORE_BATCH_MAX) {
+            int err = flush(ctx, b);
+            if (err) {
+                return err;
             }
-            break;
+            b->offset = offset;
         }
-        off_t offset = header.sector * 512;
-        if (fseek(off, offset, SEEK_SET)) {
-            err = -errno;
-            perror("seek failed");
+        b->iov[b->iovcnt++] = (struct iovec){ .iov_base = (void *)e->data, .iov_len = e->nbytes };
+        b->len += e->nbytes;
+        ++b->extents;
+    }
+    return flush(ctx, b);
+}
+
+static void *restore_thread(void *arg) {
+    struct restore_ctx *ctx = arg;
+    struct batch *b = calloc(1, sizeof(*b));
+    if (!b) {
+        atomic_store(&ctx->err, -ENOMEM);
+        return NULL;
+    }
+    if (ctx->direct && posix_memalign((void **)&b->bounce, RESTORE_DIO_ALIGN, RESTORE_BATCH_MAX)) {
+        free(b);
+        atomic_store(&ctx->err, -ENOMEM);
+        return NULL;
+    }
+    while (!atomic_load(&ctx->err)) {
+        size_t i = atomic_fetch_add(&ctx->next_job, 1);
+        if (i >= ctx->nr_jobs) {
             break;
         }
-        n = fwrite(buffer, 1, header.nbytes, off);
-        if (n < header.nbytes) {
-            err = -errno;
-            perror(dev);
+        int err = restore_job(ctx, &ctx->jobs[i], b);
+        if (err) {
+            atomic_store(&ctx->err, err);
+        }
+    }
+    free(b->bounce);
+    free(b);
+    return NULL;
+}
+
+static double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void report(struct restore_stats *stats, const char *engine, double seconds) {
+    double mib = stats->bytes / (double)(1 << 20);
+    printf("restored %zu extents (%.1f MiB) in %.3f s with %s: %.1f MiB/s",
+           stats->extents, mib, seconds, engine, seconds > 0 ? mib / seconds : 0.0);
+    if (stats->torn) {
+        printf(", %zu torn extents ignored", stats->torn);
+    }
+    printf("\n");
+}
+
+/**
+ * restore_threads restores the extents of ctx with a pool of threads, it returns the number of threads started.
+ */
+static int restore_threads(struct restore_ctx *ctx, int threads) {
+    int err = make_jobs(ctx);
+    if (err) {
+        atomic_store(&ctx->err, err);
+        return 0;
+    }
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    if (!tids) {
+        atomic_store(&ctx->err, -ENOMEM);
+        return 0;
+    }
+    int started = 0;
+    for (; started < threads; ++started) {
+        if (pthread_create(&tids[started], NULL, restore_thread, ctx)) {
             break;
         }
     }
-    if (buffer) {
-        free(buffer);
+    if (!started) {
+        restore_thread(ctx);
+        started = 1;
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(tids[i], NULL);
     }
-    fclose(iff);
-    fclose(off);
+    free(tids);
+    return started;
+}
+
+/**
+ * try_restore_uring restores the extents of ctx with io_uring, it returns false if io_uring can't be used.
+ */
+static bool try_restore_uring(struct restore_ctx *ctx, unsigned int queue_depth, struct restore_stats *stats) {
+    int err = restore_uring(ctx->sf, ctx->fd, queue_depth, stats);
+    if (err == -ENOSYS) {
+        fprintf(stderr, "io_uring is not available, falling back to threads\n");
+        return false;
+    }
+    if (err == -EOPNOTSUPP) {
+        fprintf(stderr, "the snapshot has overlapping extents, falling back to threads\n");
+        return false;
+    }
+    atomic_store(&ctx->err, err);
+    return true;
+}
+
+/**
+ * restore_snapshot writes the sectors saved in the data file snapshot to dev. The file is mapped in memory and its extents are sorted
+ * by sector, the runs of contiguous extents are written by a pool of threads with vectored writes, or by io_uring if opts->uring is true.
+ */
+int restore_snapshot(const char *dev, const char *snapshot, const struct restore_opts *opts) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct snapfile sf;
+    int err = snapfile_open(&sf, snapshot);
+    if (err) {
+        return err;
+    }
+    snapfile_sort(&sf);
+
+    struct restore_ctx ctx = {
+        .sf = &sf,
+        .dev = dev,
+        .direct = opts->direct,
+    };
+    ctx.fd = open(dev, O_WRONLY | (opts->direct ? O_DIRECT : 0));
+    if (ctx.fd < 0) {
+        perror(dev);
+        err = -errno;
+        goto out;
+    }
+
+    char engine[64];
+    struct restore_stats stats = { 0 };
+    if (opts->uring && try_restore_uring(&ctx, opts->queue_depth, &stats)) {
+        snprintf(engine, sizeof(engine), "io_uring (queue depth %u)", opts->queue_depth);
+    } else {
+        int started = restore_threads(&ctx, opts->threads > 0 ? opts->threads : 1);
+        snprintf(engine, sizeof(engine), "%d threads", started);
+        stats.bytes = atomic_load(&ctx.bytes);
+        stats.extents = atomic_load(&ctx.extents);
+        stats.torn = atomic_load(&ctx.torn);
+    }
+    stats.torn += sf.torn;
+    err = atomic_load(&ctx.err);
+    if (!err && fdatasync(ctx.fd)) {
+        perror(dev);
+        err = -errno;
+    }
+    report(&stats, engine, elapsed(&start));
+    free(ctx.jobs);
+    close(ctx.fd);
+out:
+    snapfile_close(&sf);
     return err;
-}
\ No newline at end of file
+}
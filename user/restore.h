@@ -1,6 +1,18 @@
 #ifndef AOS_RESTORE_H
 #define AOS_RESTORE_H
+#include <stdbool.h>
 
-int restore_snapshot(const char *dev, const char *snapshot);
+struct restore_opts {
+    // number of threads that write to the device
+    int          threads;
+    // if true the device is opened with O_DIRECT
+    bool         direct;
+    // if true the extents are restored with io_uring, falling back to threads if it isn't available
+    bool         uring;
+    // number of extents read and written at the same time by io_uring
+    unsigned int queue_depth;
+};
 
-#endif
\ No newline at end of file
+int restore_snapshot(const char *dev, const char *snapshot, const struct restore_opts *opts);
+
+#endif
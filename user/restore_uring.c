@@ -0,0 +1,207 @@
+#include "restore_uring.h"
+#include <errno.h>
+#include <stdio.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+// minimum size of the registered buffer of a slot, it's enlarged to hold the longest extent
+#define URING_BUF_MIN   (1UL << 20)
+// alignment of the registered buffers, so the device can be written with O_DIRECT
+#define URING_BUF_ALIGN (4096)
+
+/**
+ * slot restores one extent at a time: it reads the sectors from the data file to its registered buffer, verifies them and writes
+ * them to the device. done is the number of bytes of the current operation already completed.
+ */
+struct slot {
+    struct extent *e;
+    char          *buf;
+    int            index;
+    size_t         done;
+    bool           writing;
+};
+
+struct uring_ctx {
+    struct io_uring       ring;
+    struct snapfile      *sf;
+    int                   fd;
+    struct slot          *slots;
+    size_t                next;
+    unsigned int          inflight;
+    struct restore_stats *stats;
+    int                   err;
+};
+
+static void queue_op(struct uring_ctx *ctx, struct slot *s) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx->ring);
+    struct extent *e = s->e;
+    if (s->writing) {
+        io_uring_prep_write_fixed(sqe, ctx->fd, s->buf + s->done, e->nbytes - s->done, e->sector * 512 + s->done, s->index);
+    } else {
+        off_t offset = e->data - ctx->sf->map;
+        io_uring_prep_read_fixed(sqe, ctx->sf->fd, s->buf + s->done, e->nbytes - s->done, offset + s->done, s->index);
+    }
+    io_uring_sqe_set_data(sqe, s);
+}
+
+/**
+ * next_extent gives to s the next extent to restore, it returns false if there are no more extents or an error occurred.
+ */
+static bool next_extent(struct uring_ctx *ctx, struct slot *s) {
+    if (ctx->err || ctx->next == ctx->sf->nr_extents) {
+        return false;
+    }
+    s->e = &ctx->sf->extents[ctx->next++];
+    s->done = 0;
+    s->writing = false;
+    queue_op(ctx, s);
+    return true;
+}
+
+static void complete(struct uring_ctx *ctx, struct slot *s, int res) {
+    struct extent *e = s->e;
+    if (res <= 0) {
+        ctx->err = res ? res : -EIO;
+        fprintf(stderr, "cannot %s sectors [%llu, %llu): %s\n", s->writing ? "write" : "read",
+                (unsigned long long)e->sector, (unsigned long long)(e->sector + e->nbytes / 512), strerror(-ctx->err));
+        --ctx->inflight;
+        return;
+    }
+    s->done += res;
+    if (s->done < e->nbytes) {
+        queue_op(ctx, s);
+        return;
+    }
+    if (!s->writing) {
+        if (extent_check(e, s->buf)) {
+            s->writing = true;
+            s->done = 0;
+            queue_op(ctx, s);
+            return;
+        }
+        fprintf(stderr, "ignoring torn extent of sector %llu\n", (unsigned long long)e->sector);
+        ++ctx->stats->torn;
+    } else {
+        ctx->stats->bytes += e->nbytes;
+        ++ctx->stats->extents;
+    }
+    if (!next_extent(ctx, s)) {
+        --ctx->inflight;
+    }
+}
+
+static bool extents_overlap(struct snapfile *sf) {
+    for (size_t i = 1; i < sf->nr_extents; ++i) {
+        struct extent *prev = &sf->extents[i - 1];
+        if (prev->sector + prev->nbytes / 512 > sf->extents[i].sector) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int run(struct uring_ctx *ctx, unsigned int queue_depth) {
+    for (unsigned int i = 0; i < queue_depth && next_extent(ctx, &ctx->slots[i]); ++i) {
+        ++ctx->inflight;
+    }
+    while (ctx->inflight) {
+        int err = io_uring_submit(&ctx->ring);
+        if (err < 0 && err != -EINTR) {
+            return err;
+        }
+        struct io_uring_cqe *cqe;
+        err = io_uring_wait_cqe(&ctx->ring, &cqe);
+        if (err == -EINTR) {
+            continue;
+        }
+        if (err) {
+            return err;
+        }
+        // every completion queued at the moment is reaped before submitting again
+        unsigned int head, n = 0;
+        io_uring_for_each_cqe(&ctx->ring, head, cqe) {
+            complete(ctx, io_uring_cqe_get_data(cqe), cqe->res);
+            ++n;
+        }
+        io_uring_cq_advance(&ctx->ring, n);
+    }
+    return ctx->err;
+}
+
+/**
+ * restore_uring restores the extents of sf, sorted by sector, to the device fd with io_uring. Each of the queue_depth slots reads an
+ * extent to its registered buffer and then writes it, so up to queue_depth reads and writes are in flight. It returns -ENOSYS if
+ * io_uring can't be used, -EOPNOTSUPP if two extents overlap because their writes couldn't be reordered.
+ */
+int restore_uring(struct snapfile *sf, int fd, unsigned int queue_depth, struct restore_stats *stats) {
+    if (extents_overlap(sf)) {
+        return -EOPNOTSUPP;
+    }
+    if (!sf->nr_extents) {
+        return 0;
+    }
+    if (queue_depth > sf->nr_extents) {
+        queue_depth = sf->nr_extents;
+    }
+    size_t buf_size = URING_BUF_MIN;
+    for (size_t i = 0; i < sf->nr_extents; ++i) {
+        if (sf->extents[i].nbytes > buf_size) {
+            buf_size = sf->extents[i].nbytes;
+        }
+    }
+    buf_size = (buf_size + URING_BUF_ALIGN - 1) & ~(URING_BUF_ALIGN - 1);
+
+    struct uring_ctx ctx = {
+        .sf = sf,
+        .fd = fd,
+        .stats = stats,
+    };
+    int err = io_uring_queue_init(queue_depth, &ctx.ring, 0);
+    if (err) {
+        return -ENOSYS;
+    }
+    char *bufs = NULL;
+    ctx.slots = calloc(queue_depth, sizeof(*ctx.slots));
+    struct iovec *iov = calloc(queue_depth, sizeof(*iov));
+    if (!ctx.slots || !iov || posix_memalign((void **)&bufs, URING_BUF_ALIGN, buf_size * queue_depth)) {
+        err = -ENOMEM;
+        goto out;
+    }
+    for (unsigned int i = 0; i < queue_depth; ++i) {
+        ctx.slots[i].buf = bufs + i * buf_size;
+        ctx.slots[i].index = i;
+        iov[i].iov_base = ctx.slots[i].buf;
+        iov[i].iov_len = buf_size;
+    }
+    err = io_uring_register_buffers(&ctx.ring, iov, queue_depth);
+    if (err) {
+        // e.g. RLIMIT_MEMLOCK is too low
+        err = -ENOSYS;
+        goto out_bufs;
+    }
+    err = run(&ctx, queue_depth);
+    io_uring_unregister_buffers(&ctx.ring);
+out_bufs:
+    free(bufs);
+out:
+    free(iov);
+    free(ctx.slots);
+    io_uring_queue_exit(&ctx.ring);
+    return err;
+}
+
+#else
+
+int restore_uring(struct snapfile *sf, int fd, unsigned int queue_depth, struct restore_stats *stats) {
+    (void)sf;
+    (void)fd;
+    (void)queue_depth;
+    (void)stats;
+    return -ENOSYS;
+}
+
+#endif
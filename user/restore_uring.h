@@ -0,0 +1,14 @@
+#ifndef AOS_RESTORE_URING_H
+#define AOS_RESTORE_URING_H
+#include "snapfile.h"
+#include <stddef.h>
+
+struct restore_stats {
+    size_t bytes;
+    size_t extents;
+    size_t torn;
+};
+
+int restore_uring(struct snapfile *sf, int fd, unsigned int queue_depth, struct restore_stats *stats);
+
+#endif
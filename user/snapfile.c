@@ -0,0 +1,325 @@
+#include "snapfile.h"
+#include "../include/snap_format.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct snap_header {
+    unsigned long sector;
+    unsigned long nbytes;
+};
+
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t c = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = c;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t) = crc32c_sw;
+
+/**
+ * crc32c updates crc with len bytes of buf, like the kernel it doesn't invert the result.
+ */
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    return crc32c_fn(crc, buf, len);
+}
+
+static void crc32c_select(void) {
+    crc32c_init();
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_fn = crc32c_hw;
+    }
+#endif
+}
+
+bool extent_valid(const struct extent *e) {
+    return extent_check(e, e->data);
+}
+
+/**
+ * extent_check verifies the checksum of e against a copy of its sectors stored at data.
+ */
+bool extent_check(const struct extent *e, const void *data) {
+    if (!e->checked) {
+        return true;
+    }
+    uint32_t crc = ~0U;
+    if (e->crc_off) {
+        static const char zeros[sizeof(e->crc)];
+        crc = crc32c(crc, e->hdr, e->crc_off);
+        crc = crc32c(crc, zeros, sizeof(zeros));
+        crc = crc32c(crc, e->hdr + e->crc_off + sizeof(zeros), e->hdr_len - e->crc_off - sizeof(zeros));
+    } else {
+        crc = crc32c(crc, e->hdr, e->hdr_len);
+    }
+    return crc32c(crc, data, e->nbytes) == e->crc;
+}
+
+static int add_extent(struct snapfile *sf, const struct extent *e) {
+    if (sf->nr_extents == sf->capacity) {
+        size_t capacity = sf->capacity ? sf->capacity * 2 : 1024;
+        struct extent *extents = realloc(sf->extents, capacity * sizeof(*extents));
+        if (!extents) {
+            return -ENOMEM;
+        }
+        sf->extents = extents;
+        sf->capacity = capacity;
+    }
+    sf->extents[sf->nr_extents++] = *e;
+    return 0;
+}
+
+/**
+ * parse_v1 reads sequentially a data file that uses the format version 1, that is a sequence of {sector, nbytes} headers each one
+ * followed by nbytes bytes. A last block shorter than its header says is dropped.
+ */
+static int parse_v1(struct snapfile *sf, const char *path) {
+    size_t pos = 0;
+    while (pos + sizeof(struct snap_header) <= sf->size) {
+        struct snap_header header;
+        const char *hdr = sf->map + pos;
+        memcpy(&header, hdr, sizeof(header));
+        pos += sizeof(header);
+        if (header.nbytes > sf->size - pos) {
+            fprintf(stderr, "EOF met too early in %s\n", path);
+            ++sf->torn;
+            break;
+        }
+        if (header.nbytes) {
+            struct extent e = {
+                .sector = header.sector,
+                .nbytes = header.nbytes,
+                .hdr = hdr,
+                .data = sf->map + pos,
+                .hdr_len = sizeof(header),
+            };
+            int err = add_extent(sf, &e);
+            if (err) {
+                return err;
+            }
+        }
+        pos += header.nbytes;
+    }
+    return 0;
+}
+
+/**
+ * rec_at returns the record at pos if its header is consistent and the record ends before the end of the file, NULL otherwise.
+ */
+static const struct snap_rec_header *rec_at(struct snapfile *sf, uint64_t pos) {
+    if (pos % SNAP_REC_ALIGN || pos > sf->size || sf->size - pos < sizeof(struct snap_rec_header)) {
+        return NULL;
+    }
+    const struct snap_rec_header *h = (const void *)(sf->map + pos);
+    if (h->magic != SNAP_REC_SUPER && h->magic != SNAP_REC_EXTENT && h->magic != SNAP_REC_INDEX) {
+        return NULL;
+    }
+    if (h->data_off < sizeof(*h) || h->data_off + (uint64_t)h->nbytes > h->rec_len || h->rec_len % SNAP_REC_ALIGN) {
+        return NULL;
+    }
+    return h->rec_len <= sf->size - pos ? h : NULL;
+}
+
+static struct extent rec_extent(const struct snap_rec_header *h) {
+    struct extent e = {
+        .sector = h->sector,
+        .nbytes = h->nbytes,
+        .crc = h->crc,
+        .hdr = (const char *)h,
+        .data = (const char *)h + h->data_off,
+        .hdr_len = sizeof(*h),
+        .crc_off = offsetof(struct snap_rec_header, crc),
+        .checked = true,
+    };
+    return e;
+}
+
+/**
+ * load_index reads the index of a data file made of a single segment that has been closed cleanly. It returns false if the file
+ * has no valid index.
+ */
+static bool load_index(struct snapfile *sf, int *err) {
+    struct snap_footer footer;
+    if (sf->size < sizeof(footer)) {
+        return false;
+    }
+    memcpy(&footer, sf->map + sf->size - sizeof(footer), sizeof(footer));
+    if (footer.magic != SNAP_FOOTER_MAGIC || footer.segment_offset) {
+        return false;
+    }
+    const struct snap_rec_header *h = rec_at(sf, footer.index_offset);
+    if (!h || h->magic != SNAP_REC_INDEX || h->nbytes != footer.count * sizeof(struct snap_index_entry)) {
+        return false;
+    }
+    struct extent index = rec_extent(h);
+    if (!extent_valid(&index)) {
+        return false;
+    }
+    const struct snap_index_entry *entries = (const void *)index.data;
+    for (uint64_t i = 0; i < footer.count; ++i) {
+        const struct snap_rec_header *x = rec_at(sf, entries[i].offset);
+        if (!x || x->magic != SNAP_REC_EXTENT || x->sector != entries[i].sector) {
+            fprintf(stderr, "ignoring torn extent of sector %llu\n", (unsigned long long)entries[i].sector);
+            ++sf->torn;
+            continue;
+        }
+        struct extent e = rec_extent(x);
+        *err = add_extent(sf, &e);
+        if (*err) {
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * parse_v2 reads a data file that uses the format version 2, from its index if the file has one. Otherwise the records are scanned
+ * sequentially, the space reserved by a writer that crashed reads as zeros and it is skipped SNAP_REC_ALIGN bytes at a time.
+ * The checksums of the extents are verified by extent_valid.
+ */
+static int parse_v2(struct snapfile *sf, const char *path) {
+    int err = 0;
+    if (load_index(sf, &err)) {
+        return err;
+    }
+    uint64_t pos = 0;
+    while (pos + sizeof(struct snap_rec_header) <= sf->size) {
+        const struct snap_rec_header *h = rec_at(sf, pos);
+        if (!h) {
+            const struct snap_rec_header *torn = (const void *)(sf->map + pos);
+            if (torn->magic == SNAP_REC_EXTENT) {
+                fprintf(stderr, "ignoring torn extent of sector %llu\n", (unsigned long long)torn->sector);
+                ++sf->torn;
+            }
+            pos += SNAP_REC_ALIGN;
+            continue;
+        }
+        struct extent e = rec_extent(h);
+        if (h->magic == SNAP_REC_SUPER) {
+            const struct snap_superblock *sb = (const void *)e.data;
+            if (!extent_valid(&e)) {
+                pos += SNAP_REC_ALIGN;
+                continue;
+            }
+            if (h->nbytes < sizeof(*sb) || sb->version != SNAP_FORMAT_VERSION) {
+                fprintf(stderr, "unsupported format version of %s\n", path);
+                return -EINVAL;
+            }
+        } else if (h->magic == SNAP_REC_EXTENT) {
+            err = add_extent(sf, &e);
+            if (err) {
+                return err;
+            }
+        }
+        pos += h->rec_len;
+    }
+    return 0;
+}
+
+int snapfile_open(struct snapfile *sf, const char *path) {
+    memset(sf, 0, sizeof(*sf));
+    crc32c_select();
+    sf->fd = open(path, O_RDONLY);
+    if (sf->fd < 0) {
+        perror(path);
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(sf->fd, &st)) {
+        perror(path);
+        int err = -errno;
+        close(sf->fd);
+        return err;
+    }
+    sf->size = st.st_size;
+    if (sf->size) {
+        void *map = mmap(NULL, sf->size, PROT_READ, MAP_PRIVATE, sf->fd, 0);
+        if (map == MAP_FAILED) {
+            perror(path);
+            int err = -errno;
+            close(sf->fd);
+            return err;
+        }
+        madvise(map, sf->size, MADV_WILLNEED);
+        sf->map = map;
+    }
+    const struct snap_rec_header *h = (const void *)sf->map;
+    // the nbytes of the first header of a version 1 file is never zero
+    if (sf->size >= sizeof(*h) && h->magic == SNAP_REC_SUPER && !h->sector) {
+        sf->version = SNAP_FORMAT_VERSION;
+    } else {
+        sf->version = 1;
+    }
+    int err = sf->version == 1 ? parse_v1(sf, path) : parse_v2(sf, path);
+    if (err) {
+        snapfile_close(sf);
+    }
+    return err;
+}
+
+void snapfile_close(struct snapfile *sf) {
+    free(sf->extents);
+    if (sf->map) {
+        munmap((void *)sf->map, sf->size);
+    }
+    close(sf->fd);
+    memset(sf, 0, sizeof(*sf));
+    sf->fd = -1;
+}
+
+static int extent_cmp(const void *a, const void *b) {
+    const struct extent *x = a, *y = b;
+    if (x->sector != y->sector) {
+        return x->sector < y->sector ? -1 : 1;
+    }
+    // the extents of the same sector are restored in file order
+    return x->hdr < y->hdr ? -1 : x->hdr > y->hdr;
+}
+
+/**
+ * snapfile_sort sorts the extents of sf by sector.
+ */
+void snapfile_sort(struct snapfile *sf) {
+    qsort(sf->extents, sf->nr_extents, sizeof(*sf->extents), extent_cmp);
+}
@@ -0,0 +1,49 @@
+#ifndef AOS_SNAPFILE_H
+#define AOS_SNAPFILE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * extent is a run of sectors saved in a snapshot data file, hdr and data point to the mapping of the file.
+ * If checked is true the crc32c of the header (hdr_len bytes, whose crc is zeroed when crc_off is not zero) followed by the sectors
+ * must be crc.
+ */
+struct extent {
+    uint64_t    sector;
+    uint32_t    nbytes;
+    uint32_t    crc;
+    const char *hdr;
+    const char *data;
+    uint8_t     hdr_len;
+    uint8_t     crc_off;
+    bool        checked;
+};
+
+/**
+ * snapfile is a snapshot data file mapped in memory together with the list of its extents, in file order until snapfile_sort
+ * is called.
+ */
+struct snapfile {
+    int            fd;
+    const char    *map;
+    size_t         size;
+    int            version;
+    struct extent *extents;
+    size_t         nr_extents;
+    size_t         capacity;
+    // extents dropped while parsing the file because they were torn
+    size_t         torn;
+};
+
+int snapfile_open(struct snapfile *sf, const char *path);
+
+void snapfile_close(struct snapfile *sf);
+
+void snapfile_sort(struct snapfile *sf);
+
+bool extent_valid(const struct extent *e);
+
+bool extent_check(const struct extent *e, const void *data);
+
+#endif